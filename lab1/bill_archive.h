@@ -0,0 +1,122 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+/// @brief One line of a compacted bill as stored in the archive
+struct ArchivedBillLine
+{
+    // number of the bill among all the bills archived by the list
+    int64_t bill_number;
+    int32_t product_id;
+    int32_t quantity;
+    int64_t amount;
+};
+
+/// @brief Append-only file keeping the lines of the bills a bill list compacted away. Nothing reads it on the sale path,
+/// it only exists so the detail of an old bill can still be looked up. The list archives its bills in number order,
+/// so the lines of one bill are found with a binary search over the file.
+class BillArchive
+{
+private:
+    std::string path;
+    std::FILE *file;
+    long long int line_count = 0;
+    std::mutex file_lock;
+
+    static void check(bool ok, const std::string &what)
+    {
+        if (!ok)
+            throw std::runtime_error("BillArchive: " + what + ": " + std::strerror(errno));
+    }
+
+    void readLine(long long int index, ArchivedBillLine &line)
+    {
+        check(std::fseek(this->file, index * sizeof(ArchivedBillLine), SEEK_SET) == 0, "seek " + this->path);
+        check(std::fread(&line, sizeof(ArchivedBillLine), 1, this->file) == 1, "read " + this->path);
+    }
+
+public:
+    /// @brief Creates an empty archive at `path`, replacing any previous one: a file only ever holds the bills of one list
+    explicit BillArchive(std::string path) : path{path}, file{std::fopen(path.c_str(), "w+b")}
+    {
+        check(this->file != nullptr, "open " + path);
+    }
+
+    BillArchive(const BillArchive &) = delete;
+    BillArchive &operator=(const BillArchive &) = delete;
+
+    ~BillArchive()
+    {
+        std::fclose(this->file);
+    }
+
+    void append(const std::vector<ArchivedBillLine> &lines)
+    {
+        std::lock_guard<std::mutex> guard(this->file_lock);
+
+        check(std::fseek(this->file, 0, SEEK_END) == 0, "seek " + this->path);
+        check(std::fwrite(lines.data(), sizeof(ArchivedBillLine), lines.size(), this->file) == lines.size(), "write " + this->path);
+        check(std::fflush(this->file) == 0, "flush " + this->path);
+
+        this->line_count += lines.size();
+    }
+
+    long long int getLineCount()
+    {
+        std::lock_guard<std::mutex> guard(this->file_lock);
+        return this->line_count;
+    }
+
+    /// @brief Calls `visit` with every archived line, oldest first
+    template <typename F>
+    void forEach(F &&visit)
+    {
+        std::lock_guard<std::mutex> guard(this->file_lock);
+        ArchivedBillLine buffer[1024];
+
+        check(std::fseek(this->file, 0, SEEK_SET) == 0, "seek " + this->path);
+
+        size_t count;
+        while ((count = std::fread(buffer, sizeof(ArchivedBillLine), 1024, this->file)) > 0)
+            for (size_t index = 0; index < count; ++index)
+                visit(buffer[index]);
+    }
+
+    /// @brief Lines of the bill numbered `bill_number`, empty if the bill was not archived or had no lines. O(log lines) reads.
+    std::vector<ArchivedBillLine> findBill(long long int bill_number)
+    {
+        std::lock_guard<std::mutex> guard(this->file_lock);
+        std::vector<ArchivedBillLine> lines;
+        ArchivedBillLine line;
+
+        // first line of a bill numbered `bill_number` or more
+        long long int low = 0, high = this->line_count;
+        while (low < high)
+        {
+            long long int middle = low + (high - low) / 2;
+            this->readLine(middle, line);
+
+            if (line.bill_number < bill_number)
+                low = middle + 1;
+            else high = middle;
+        }
+
+        for (long long int index = low; index < this->line_count; ++index)
+        {
+            this->readLine(index, line);
+            if (line.bill_number != bill_number)
+                break;
+
+            lines.push_back(line);
+        }
+
+        return lines;
+    }
+};
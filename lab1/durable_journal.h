@@ -0,0 +1,361 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "file_guard.h"
+
+/// @brief One sold line item as stored on disk
+struct DurableRecord
+{
+    // (writer id << 32) | bill id, unique over the whole journal
+    uint64_t bill_key;
+    int32_t product_id;
+    int32_t quantity;
+    int32_t price;
+
+    // written last, 0 while the slot is empty or being written
+    uint32_t checksum;
+
+    uint32_t computeChecksum() const
+    {
+        uint64_t hash = 1469598103934665603ULL;
+        const uint32_t words[] = {(uint32_t)bill_key, (uint32_t)(bill_key >> 32), (uint32_t)product_id, (uint32_t)quantity, (uint32_t)price};
+
+        for (uint32_t word : words)
+            hash = (hash ^ word) * 1099511628211ULL;
+
+        return (uint32_t)(hash ^ (hash >> 32)) | 1;
+    }
+};
+
+enum FsyncPolicy
+{
+    // never sync, the OS writes the pages back whenever it wants
+    FSYNC_NONE,
+    // a background thread syncs every interval, sales never wait
+    FSYNC_INTERVAL,
+    // a sale waits until its record is synced, one sync covers every record appended meanwhile
+    FSYNC_GROUP_COMMIT
+};
+
+/// @brief Append-only on-disk journal of sold line items, spread over fixed-size mmap'd segment files.
+/// Any number of threads append concurrently: a slot is reserved with one atomic add and filled in the mapped segment.
+/// A flusher thread syncs the contiguous prefix of complete records and publishes it as the durable watermark.
+class DurableJournal
+{
+private:
+    static constexpr int MAX_SEGMENTS = 4096;
+    // longest the group-commit flusher sleeps while the next record is being written
+    static constexpr std::chrono::microseconds GROUP_COMMIT_RETRY{50};
+
+    std::string directory;
+    long long int segment_records;
+    FsyncPolicy policy;
+    std::chrono::milliseconds interval;
+
+    std::atomic<DurableRecord *> segments[MAX_SEGMENTS] = {};
+    int segment_files[MAX_SEGMENTS];
+    std::mutex segment_lock;
+
+    std::atomic<int> next_writer = 0;
+
+    // slots handed out to appenders
+    std::atomic<long long int> reserved = 0;
+    // every record below this one is synced to disk
+    std::atomic<long long int> durable = 0;
+    // highest watermark a sale is waiting for
+    std::atomic<long long int> requested = 0;
+
+    std::mutex flush_lock;
+    std::condition_variable flush_requested;
+    std::condition_variable flush_done;
+    bool stopping = false;
+    std::thread flusher;
+
+    std::atomic<long long int> sync_count = 0;
+
+    static std::string segmentPath(std::string directory, int segment)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/segment-%06d.log", segment);
+        return directory + name;
+    }
+
+    static void check(bool ok, const std::string &what)
+    {
+        if (!ok)
+            throw std::runtime_error("DurableJournal: " + what + ": " + std::strerror(errno));
+    }
+
+    size_t segmentBytes()
+    {
+        return (size_t)this->segment_records * sizeof(DurableRecord);
+    }
+
+    /// @brief Maps the segment, creating its file if needed
+    DurableRecord *mapSegment(int segment)
+    {
+        DurableRecord *records = this->segments[segment].load(std::memory_order_acquire);
+        if (records != nullptr)
+            return records;
+
+        std::lock_guard<std::mutex> guard(this->segment_lock);
+
+        records = this->segments[segment].load(std::memory_order_relaxed);
+        if (records != nullptr)
+            return records;
+
+        if (segment >= MAX_SEGMENTS)
+            throw std::runtime_error("DurableJournal: too many segments");
+
+        std::string path = segmentPath(this->directory, segment);
+        FileGuard file{open(path.c_str(), O_RDWR | O_CREAT, 0644)};
+        check(file.file >= 0, "open " + path);
+        check(ftruncate(file.file, this->segmentBytes()) == 0, "ftruncate " + path);
+
+        void *memory = mmap(nullptr, this->segmentBytes(), PROT_READ | PROT_WRITE, MAP_SHARED, file.file, 0);
+        check(memory != MAP_FAILED, "mmap " + path);
+
+        // both stay open until the journal is destroyed
+        this->segment_files[segment] = file.release();
+        records = (DurableRecord *)memory;
+        this->segments[segment].store(records, std::memory_order_release);
+
+        return records;
+    }
+
+    DurableRecord &slot(long long int index)
+    {
+        return this->mapSegment(index / this->segment_records)[index % this->segment_records];
+    }
+
+    bool isComplete(long long int index)
+    {
+        return std::atomic_ref<uint32_t>(this->slot(index).checksum).load(std::memory_order_acquire) != 0;
+    }
+
+    /// @brief Syncs the records in [from, to) to disk
+    void syncRange(long long int from, long long int to)
+    {
+        long page = sysconf(_SC_PAGESIZE);
+
+        while (from < to)
+        {
+            long long int segment = from / this->segment_records;
+            long long int end = std::min(to, (segment + 1) * this->segment_records);
+
+            char *base = (char *)this->segments[segment].load(std::memory_order_acquire);
+            size_t first = (size_t)(from % this->segment_records) * sizeof(DurableRecord);
+            size_t last = (size_t)((end - 1) % this->segment_records + 1) * sizeof(DurableRecord);
+            size_t aligned = first - first % page;
+
+            check(msync(base + aligned, last - aligned, MS_SYNC) == 0, "msync");
+            from = end;
+        }
+
+        this->sync_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// @brief Syncs every complete record following the durable watermark and advances it
+    /// @return false when the next record is still being written and nothing was synced
+    bool flush()
+    {
+        long long int from = this->durable.load(std::memory_order_relaxed);
+        long long int limit = this->reserved.load(std::memory_order_acquire);
+        long long int to = from;
+
+        while (to < limit && this->isComplete(to))
+            ++to;
+
+        if (to == from)
+            return false;
+
+        if (this->policy != FSYNC_NONE)
+            this->syncRange(from, to);
+
+        {
+            std::lock_guard<std::mutex> guard(this->flush_lock);
+            this->durable.store(to, std::memory_order_release);
+        }
+        this->flush_done.notify_all();
+        return true;
+    }
+
+    void flusherLoop()
+    {
+        std::unique_lock<std::mutex> lock(this->flush_lock);
+
+        while (!this->stopping)
+        {
+            if (this->policy == FSYNC_GROUP_COMMIT)
+                this->flush_requested.wait(lock, [this]
+                                           { return this->stopping || this->requested.load() > this->durable.load(); });
+            else
+                this->flush_requested.wait_for(lock, this->interval, [this]
+                                               { return this->stopping; });
+
+            lock.unlock();
+            bool progress = this->flush();
+            lock.lock();
+
+            // the next record below `requested` is still being written and its owner notifies once it commits it,
+            // so sleep instead of spinning; the wait is bounded because the owner may have committed before we slept
+            if (this->policy == FSYNC_GROUP_COMMIT && !progress)
+                this->flush_requested.wait_for(lock, GROUP_COMMIT_RETRY, [this]
+                                               { return this->stopping || this->isComplete(this->durable.load()); });
+        }
+    }
+
+public:
+    /// @param directory Existing directory holding the segment files
+    /// @param segment_records Records per segment file
+    /// @param policy When records are synced to disk
+    /// @param interval Time between two syncs with FSYNC_INTERVAL
+    DurableJournal(std::string directory, long long int segment_records, FsyncPolicy policy, std::chrono::milliseconds interval)
+        : directory{directory}, segment_records{segment_records}, policy{policy}, interval{interval}
+    {
+        this->flusher = std::thread(&DurableJournal::flusherLoop, this);
+    }
+
+    DurableJournal(const DurableJournal &) = delete;
+    DurableJournal &operator=(const DurableJournal &) = delete;
+
+    ~DurableJournal()
+    {
+        {
+            std::lock_guard<std::mutex> guard(this->flush_lock);
+            this->stopping = true;
+        }
+        this->flush_requested.notify_all();
+        this->flusher.join();
+
+        this->flush();
+
+        for (int segment = 0; segment < MAX_SEGMENTS; ++segment)
+        {
+            DurableRecord *records = this->segments[segment].load(std::memory_order_relaxed);
+            if (records == nullptr)
+                continue;
+
+            munmap(records, this->segmentBytes());
+            close(this->segment_files[segment]);
+        }
+    }
+
+    /// @brief Removes the segment files left in `directory` by a previous journal
+    static void clear(std::string directory)
+    {
+        for (int segment = 0; segment < MAX_SEGMENTS; ++segment)
+            if (unlink(segmentPath(directory, segment).c_str()) != 0)
+                break;
+    }
+
+    /// @brief Id for a sale thread, used to build bill keys unique over the whole journal
+    int registerWriter()
+    {
+        return this->next_writer.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static uint64_t billKey(int writer, int bill_id)
+    {
+        return ((uint64_t)(uint32_t)writer << 32) | (uint32_t)bill_id;
+    }
+
+    /// @brief Stores a line item without waiting for the disk
+    /// @return Sequence number to pass to commit()
+    long long int append(uint64_t bill_key, int product_id, int quantity, int price)
+    {
+        long long int index = this->reserved.fetch_add(1, std::memory_order_acq_rel);
+        DurableRecord &record = this->slot(index);
+
+        record.bill_key = bill_key;
+        record.product_id = product_id;
+        record.quantity = quantity;
+        record.price = price;
+        std::atomic_ref<uint32_t>(record.checksum).store(record.computeChecksum(), std::memory_order_release);
+
+        return index + 1;
+    }
+
+    /// @brief With FSYNC_GROUP_COMMIT, waits until the record with the given sequence number is on disk. Does nothing otherwise.
+    void commit(long long int sequence)
+    {
+        if (this->policy != FSYNC_GROUP_COMMIT || this->durable.load(std::memory_order_acquire) >= sequence)
+            return;
+
+        long long int requested = this->requested.load(std::memory_order_relaxed);
+        while (requested < sequence && !this->requested.compare_exchange_weak(requested, sequence, std::memory_order_relaxed))
+            ;
+
+        std::unique_lock<std::mutex> lock(this->flush_lock);
+        this->flush_requested.notify_one();
+        this->flush_done.wait(lock, [&]
+                              { return this->durable.load(std::memory_order_relaxed) >= sequence; });
+    }
+
+    long long int getRecordCount()
+    {
+        return this->reserved.load(std::memory_order_acquire);
+    }
+
+    long long int getSyncCount()
+    {
+        return this->sync_count.load(std::memory_order_relaxed);
+    }
+
+    /// @brief Reads every complete record of the journal in `directory`, in append order
+    /// @return Number of records read
+    template <typename F>
+    static long long int replay(std::string directory, F &&visit)
+    {
+        long long int count = 0;
+
+        for (int segment = 0; segment < MAX_SEGMENTS; ++segment)
+        {
+            std::string path = segmentPath(directory, segment);
+            FileGuard file{open(path.c_str(), O_RDONLY)};
+            if (file.file < 0)
+                break;
+
+            struct stat info;
+            check(fstat(file.file, &info) == 0, "fstat " + path);
+
+            if (info.st_size > 0)
+            {
+                // unmapped even if `visit` throws
+                MappingGuard mapping{mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file.file, 0), (size_t)info.st_size};
+                check(mapping.memory != MAP_FAILED, "mmap " + path);
+                madvise(mapping.memory, info.st_size, MADV_SEQUENTIAL);
+
+                const DurableRecord *records = (const DurableRecord *)mapping.memory;
+                size_t record_count = info.st_size / sizeof(DurableRecord);
+
+                // slots reserved by a crashed process may never have been written, skip them
+                for (size_t index = 0; index < record_count; ++index)
+                {
+                    if (records[index].checksum != 0 && records[index].checksum == records[index].computeChecksum())
+                    {
+                        visit(records[index]);
+                        ++count;
+                    }
+                }
+            }
+        }
+
+        return count;
+    }
+};
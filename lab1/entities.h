@@ -1,50 +1,128 @@
+#pragma once
+
 #include <vector>
 #include <string>
+#include <string_view>
+#include <deque>
 #include <mutex>
 #include <map>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include "locks.h"
+#include "profiler.h"
+#include "bill_archive.h"
 
-class Product
+/// @brief Product data that sales never touch, kept apart from Product so it does not take room in the hot cache lines
+struct ProductDetails
+{
+    int initial_quantity = 0;
+
+    // points into the names of the ProductTable, or into memory it keeps alive such as a mapped snapshot
+    std::string_view name;
+};
+
+/// @brief Everything a sale touches, padded to a cache line of its own so neighbouring products never share one
+template <typename Policy>
+class alignas(64) BasicProduct
 {
 private:
-    int price;
-    int id;
-    int quantity;
-    int initial_quantity;
-    std::string name;
-    std::mutex object_lock;
+    // units in stock in the low 32 bits and units held by reservations in the high 32 bits: a reservation moves units between
+    // the two in one atomic step, so the inventory checks never see them in neither
+    std::atomic<uint64_t> stock = 0;
+    int price = 0;
+    int id = 0;
 
-    static inline int last_available_id = 1;
+    // seqlock version, odd while a sale holding lock() is changing the product or its bills. Reservations change the stock
+    // without lock() and move it by two, so the bumps are atomic read-modify-writes on both sides.
+    std::atomic<unsigned int> version = 0;
 
-public:
-    Product()
+    typename Policy::ProductLock object_lock;
+
+    // owned by the ProductTable holding the product
+    ProductDetails *details = nullptr;
+
+    template <typename>
+    friend class BasicProductTable;
+
+    static uint64_t packStock(int quantity, int reserved)
+    {
+        return (uint64_t)(uint32_t)reserved << 32 | (uint32_t)quantity;
+    }
+
+    static int stockQuantity(uint64_t stock)
     {
-        this->id = Product::last_available_id++;
-        this->price = 0;
-        this->quantity = 0;
-        this->initial_quantity = 0;
-        this->name = "";
+        return (int)(uint32_t)stock;
     }
 
-    Product(int price, int quantity, std::string name) : price{price},
-                                                    quantity{quantity}, initial_quantity{quantity}, name{name}
+    static int stockReserved(uint64_t stock)
     {
-        this->id = Product::last_available_id++;
+        return (int)(stock >> 32);
     }
 
-    Product(int id, int price, int quantity, std::string name) : price{price},
-                                                            quantity{quantity}, initial_quantity{quantity}, name{name}, id{id} {};
+    /// @brief Marks a change of the stock made without lock(): keeps the version even and fails the reads that started before it
+    void bumpVersion()
+    {
+        this->version.fetch_add(2, std::memory_order_release);
+    }
 
+public:
+    BasicProduct() = default;
+
+    /// @brief Buys up to `amount` units, clamped to the remaining stock. Hold lock() to keep the stock in line with the bills;
+    /// the stock itself is changed with a CAS, since reservations take units without the lock. Even under lock() a reservation
+    /// can take units after the stock was read, so the units to bill are the ones returned, never the ones asked for.
     int purchase(int amount)
     {
-        this->quantity -= amount;
-        if (this->quantity < 0)
+        return this->purchaseAtomic(amount);
+    }
+
+    /// @brief Lock-free version of purchase(), clamps and subtracts with a CAS loop. Does not need lock().
+    int purchaseAtomic(int amount)
+    {
+        uint64_t stock = this->stock.load(std::memory_order_relaxed);
+        int bought;
+
+        do
         {
-            amount = amount + quantity;
-            this->quantity = 0;
-        }
+            bought = std::min(amount, stockQuantity(stock));
+        } while (bought > 0 && !this->stock.compare_exchange_weak(stock, stock - bought, std::memory_order_acq_rel, std::memory_order_relaxed));
 
-        return amount;
+        return bought;
+    }
+
+    /// @brief Moves exactly `amount` units from the stock to the reserved units, or nothing if there are not enough. Does not need lock().
+    bool reserve(int amount)
+    {
+        uint64_t stock = this->stock.load(std::memory_order_relaxed);
+
+        do
+        {
+            if (amount <= 0 || stockQuantity(stock) < amount)
+                return false;
+        } while (!this->stock.compare_exchange_weak(stock, packStock(stockQuantity(stock) - amount, stockReserved(stock) + amount),
+                                                    std::memory_order_acq_rel, std::memory_order_relaxed));
+
+        this->bumpVersion();
+        return true;
+    }
+
+    /// @brief Puts `amount` reserved units back in stock. Does not need lock().
+    void releaseReserved(int amount)
+    {
+        this->stock.fetch_add((uint64_t)amount - ((uint64_t)amount << 32), std::memory_order_acq_rel);
+        this->bumpVersion();
+    }
+
+    /// @brief Sells `amount` reserved units, like purchase() they must go to a bill while holding lock()
+    void sellReserved(int amount)
+    {
+        this->stock.fetch_sub((uint64_t)amount << 32, std::memory_order_acq_rel);
     }
 
     int getId()
@@ -59,17 +137,29 @@ public:
 
     std::string getName()
     {
-        return this->name;
+        return this->details != nullptr ? std::string(this->details->name) : "";
     }
 
     int getQuantity()
     {
-        return this->quantity;
+        return stockQuantity(this->stock.load(std::memory_order_acquire));
+    }
+
+    int getReservedQuantity()
+    {
+        return stockReserved(this->stock.load(std::memory_order_acquire));
+    }
+
+    /// @brief Units that left the product through sales: neither in stock nor reserved. The bills must account for exactly these.
+    int getSoldQuantity()
+    {
+        uint64_t stock = this->stock.load(std::memory_order_acquire);
+        return this->getInitialQuantity() - stockQuantity(stock) - stockReserved(stock);
     }
 
     int getInitialQuantity()
     {
-        return this->initial_quantity;
+        return this->details != nullptr ? this->details->initial_quantity : 0;
     }
 
     bool tryLock()
@@ -87,60 +177,485 @@ public:
         this->object_lock.unlock();
     }
 
+    /// @brief co_await to take lock() from a coroutine without blocking its thread, only for locks with lockAsync() such as AsyncLock
+    template <typename Scheduler>
+    auto lockAsync(Scheduler &scheduler)
+    {
+        return this->object_lock.lockAsync(scheduler);
+    }
+
+    /// @brief Address of the lock taken by lock(), products sharing it must be locked only once
+    const void *lockIdentity()
+    {
+        return this->object_lock.identity();
+    }
+
+    /// @brief Starts a change of the product and of the bills referring to it, must hold lock()
+    void beginWrite()
+    {
+        this->version.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void endWrite()
+    {
+        this->version.fetch_add(1, std::memory_order_release);
+    }
+
+    /// @brief Starts an optimistic read without locking, returns the version to pass to readValid()
+    unsigned int readBegin()
+    {
+        return this->version.load(std::memory_order_acquire);
+    }
+
+    /// @brief True if no sale changed the product since readBegin() returned `start`. A reservation changes the stock in one
+    /// atomic step and bumps the version after it, so a valid read saw the stock either before or after it, never half of it.
+    bool readValid(unsigned int start)
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return (start & 1) == 0 && this->version.load(std::memory_order_relaxed) == start;
+    }
+
     std::string toString()
     {
         return "{ id: " + std::to_string(this->id) +
                ", name: " + this->getName() +
                ", price: " + std::to_string(this->price) +
-               ", quantity: " + std::to_string(this->quantity) +
-               ", initial quantity: " + std::to_string(this->quantity) +
+               ", quantity: " + std::to_string(this->getQuantity()) +
+               ", reserved: " + std::to_string(this->getReservedQuantity()) +
+               ", initial quantity: " + std::to_string(this->getInitialQuantity()) +
                " }";
     }
 };
 
+/// @brief Flat product store indexed by id, for products with ids in [1, size()]. Products are stored contiguously,
+/// their names and initial quantities in a separate array.
+template <typename Policy>
+class BasicProductTable
+{
+private:
+    std::unique_ptr<BasicProduct<Policy>[]> products;
+    std::unique_ptr<ProductDetails[]> details;
+    int product_count;
+
+    // names copied by setProduct(), a deque never moves them so the views of the details stay valid
+    std::deque<std::string> names;
+
+    // memory the names given to restoreProduct() point into
+    std::vector<std::shared_ptr<const void>> name_owners;
+
+public:
+    explicit BasicProductTable(int product_count) : products{new BasicProduct<Policy>[product_count]}, details{new ProductDetails[product_count]},
+                                                    product_count{product_count} {}
+
+    /// @brief Sets up the product with the given id, must be called before the table is shared between threads
+    void setProduct(int id, int price, int quantity, std::string name)
+    {
+        this->names.push_back(std::move(name));
+        this->restoreProduct(id, price, quantity, quantity, this->names.back());
+    }
+
+    /// @brief Sets up a product that already sold part of its stock, like setProduct(). Nothing is allocated: the name is kept
+    /// as a view, so its memory must outlive the table, see keepAlive().
+    void restoreProduct(int id, int price, int initial_quantity, int quantity, std::string_view name)
+    {
+        BasicProduct<Policy> &product = this->at(id);
+        ProductDetails &details = this->details[id - 1];
+
+        details.initial_quantity = initial_quantity;
+        details.name = name;
+
+        product.id = id;
+        product.price = price;
+        product.object_lock.describe(PRODUCT_SITE, id);
+        product.stock.store(BasicProduct<Policy>::packStock(quantity, 0), std::memory_order_relaxed);
+        product.details = &details;
+    }
+
+    /// @brief Keeps `owner` alive as long as the table, for the memory the names given to restoreProduct() point into
+    void keepAlive(std::shared_ptr<const void> owner)
+    {
+        this->name_owners.push_back(std::move(owner));
+    }
+
+    int size()
+    {
+        return this->product_count;
+    }
+
+    BasicProduct<Policy> &operator[](int id)
+    {
+        return this->products[id - 1];
+    }
+
+    BasicProduct<Policy> &at(int id)
+    {
+        if (id < 1 || id > this->product_count)
+            throw std::out_of_range("BasicProductTable::at: no product with id " + std::to_string(id));
+
+        return this->products[id - 1];
+    }
+
+    BasicProduct<Policy> *begin()
+    {
+        return this->products.get();
+    }
+
+    BasicProduct<Policy> *end()
+    {
+        return this->products.get() + this->product_count;
+    }
+};
+
 class ShopBankAccount
 {
 private:
-    long long int total = 0;
-    std::mutex object_lock;
+    static constexpr int STRIPE_COUNT = 64;
+
+    // each stripe sits on its own cache line, so threads with different stripes never share one
+    struct alignas(64) Stripe
+    {
+        std::atomic<long long int> total = 0;
+
+        // sales that called beginSale() / endSale() on this stripe
+        std::atomic<unsigned long long int> started = 0;
+        std::atomic<unsigned long long int> finished = 0;
+    };
+
+    Stripe stripes[STRIPE_COUNT];
+
+    // set by getTotalConsistent() when it gives up on optimistic reads, new sales wait while it is set
+    std::atomic<bool> draining = false;
+    std::mutex drain_lock;
+
+    static inline std::atomic<int> next_stripe = 0;
+    static inline thread_local int stripe_index = -1;
+
+    static constexpr int OPTIMISTIC_READ_ATTEMPTS = 8;
+
+    /// @brief Stripe of the calling thread, threads get stripes round-robin on first use
+    Stripe &localStripe()
+    {
+        if (stripe_index < 0)
+            stripe_index = next_stripe.fetch_add(1, std::memory_order_relaxed) % STRIPE_COUNT;
+
+        return this->stripes[stripe_index];
+    }
+
+    long long int sumStripes()
+    {
+        long long int amount = 0;
+
+        for (Stripe &stripe : this->stripes)
+            amount += stripe.total.load(std::memory_order_relaxed);
+
+        return amount;
+    }
+
+    /// @brief Reads the total and runs `read` while no sale is in progress, fails if any sale started or was running meanwhile
+    template <typename F>
+    bool tryReadConsistent(long long int &amount, F &read)
+    {
+        unsigned long long int started[STRIPE_COUNT];
+
+        for (int index = 0; index < STRIPE_COUNT; ++index)
+        {
+            started[index] = this->stripes[index].started.load(std::memory_order_acquire);
+            if (this->stripes[index].finished.load(std::memory_order_acquire) != started[index])
+                return false;
+        }
+
+        amount = this->sumStripes();
+        read();
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        for (int index = 0; index < STRIPE_COUNT; ++index)
+            if (this->stripes[index].started.load(std::memory_order_relaxed) != started[index])
+                return false;
+
+        return true;
+    }
 
 public:
+    /// @brief Adds money made before the process started, must be called before any sale
+    void restore(long long int amount)
+    {
+        this->stripes[0].total.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    /// @brief Adds the amount to the stripe of the calling thread, never blocks
     void registerTransaction(int amount)
     {
-        this->object_lock.lock();
-        this->total += amount;
-        this->object_lock.unlock();
+        this->localStripe().total.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    /// @brief Marks the start of a sale whose money and bills must be seen together by getTotalConsistent().
+    /// Must be called once all the locks needed by the sale are held, since it may wait for a consistent read to finish.
+    /// @tparam Policy Lock policy of the sale, the time it was held back is only profiled if the policy is
+    template <typename Policy>
+    void beginSale()
+    {
+        Stripe &stripe = this->localStripe();
+
+        for (;;)
+        {
+            stripe.started.fetch_add(1, std::memory_order_seq_cst);
+            if (!this->draining.load(std::memory_order_seq_cst))
+                break;
+
+            // a reader is draining the sales, step back until it is done
+            stripe.finished.fetch_add(1, std::memory_order_release);
+            std::chrono::steady_clock::time_point start;
+            if constexpr (WaitProfiler<Policy>::enabled)
+                start = std::chrono::steady_clock::now();
+
+            while (this->draining.load(std::memory_order_acquire))
+                std::this_thread::yield();
+
+            // slow path only, the profiler report shows how long sales were held back
+            if constexpr (WaitProfiler<Policy>::enabled)
+                WaitProfiler<Policy>::record(BANK_ACCOUNT_SITE, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void endSale()
+    {
+        this->localStripe().finished.fetch_add(1, std::memory_order_release);
     }
 
+    /// @brief Merges the stripes, the result is only exact if no sale is running
     long long int getTotal()
     {
-        long long int amount;
+        return this->sumStripes();
+    }
 
-        this->object_lock.lock();
-        amount = this->total;
-        this->object_lock.unlock();
+    /// @brief Like getTotalConsistent(), but never holds back sales: gives up after `attempts` optimistic reads
+    template <typename F>
+    bool tryGetTotalConsistent(long long int &amount, F &&read, int attempts)
+    {
+        std::lock_guard<std::mutex> guard(this->drain_lock);
+
+        for (int attempt = 0; attempt < attempts; ++attempt)
+        {
+            if (this->tryReadConsistent(amount, read))
+                return true;
+
+            std::this_thread::yield();
+        }
+
+        return false;
+    }
+
+    /// @brief Merges the stripes at a point where no sale is in progress and calls `read` at that same point,
+    /// so the total can be compared with the bills read inside it. Tries a few optimistic reads first and then
+    /// briefly holds back new sales until the running ones are finished.
+    template <typename F>
+    long long int getTotalConsistent(F &&read)
+    {
+        long long int amount = 0;
+        std::lock_guard<std::mutex> guard(this->drain_lock);
+
+        for (int attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS; ++attempt)
+        {
+            if (this->tryReadConsistent(amount, read))
+                return amount;
+
+            std::this_thread::yield();
+        }
+
+        this->draining.store(true, std::memory_order_seq_cst);
+
+        for (Stripe &stripe : this->stripes)
+            while (stripe.finished.load(std::memory_order_acquire) != stripe.started.load(std::memory_order_acquire))
+                std::this_thread::yield();
+
+        amount = this->sumStripes();
+        read();
+
+        this->draining.store(false, std::memory_order_release);
 
         return amount;
     }
 };
 
-class Bill
+/// @brief Running per-product totals of everything sold on registered bills, kept up to date as bills are registered or extended
+class SalesAggregates
 {
 private:
-    std::mutex object_lock;
+    struct ProductSales
+    {
+        std::atomic<long long int> quantity = 0;
+        std::atomic<long long int> amount = 0;
+    };
+
+    std::unique_ptr<ProductSales[]> sales;
+    int product_count;
+
+public:
+    /// @brief Creates empty totals for products with ids in [1, product_count]
+    explicit SalesAggregates(int product_count) : sales{new ProductSales[product_count + 1]}, product_count{product_count} {}
+
+    void recordSale(int id, long long int quantity, long long int amount)
+    {
+        this->sales[id].quantity.fetch_add(quantity, std::memory_order_release);
+        this->sales[id].amount.fetch_add(amount, std::memory_order_release);
+    }
+
+    /// @brief Like recordSale() without atomic read-modify-writes, only before the totals are shared between threads
+    void restoreSale(int id, long long int quantity, long long int amount)
+    {
+        this->sales[id].quantity.store(this->sales[id].quantity.load(std::memory_order_relaxed) + quantity, std::memory_order_relaxed);
+        this->sales[id].amount.store(this->sales[id].amount.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
 
-    // <product id, purchase count>
-    std::map<int, int> products;
+    int getProductCount()
+    {
+        return this->product_count;
+    }
+
+    long long int getQuantityFor(int id)
+    {
+        return id >= 0 && id <= this->product_count ? this->sales[id].quantity.load(std::memory_order_acquire) : 0;
+    }
+
+    long long int getAmountFor(int id)
+    {
+        return id >= 0 && id <= this->product_count ? this->sales[id].amount.load(std::memory_order_acquire) : 0;
+    }
+
+    long long int getTotalAmount()
+    {
+        long long int total = 0;
+
+        for (int id = 0; id <= this->product_count; ++id)
+            total += this->sales[id].amount.load(std::memory_order_acquire);
+
+        return total;
+    }
+};
+
+/// @brief One product sold on a bill, as passed to BasicBill::addProducts()
+struct SaleLine
+{
+    int id;
+    int quantity;
+    int price;
+};
+
+template <typename Policy>
+class BasicBill
+{
+private:
+    typename Policy::ObjectLock object_lock;
+
+    struct BillLine
+    {
+        int quantity = 0;
+        long long int amount = 0;
+    };
+
+    // <product id, purchase count and value>
+    std::map<int, BillLine> products;
 
     // bill value
-    int total_amount = 0;
+    long long int total_amount = 0;
+
+    // lock-free bills only: purchase count indexed by product id, written with addProductAtomic()
+    std::unique_ptr<std::atomic<int>[]> counters;
+    int counter_count = 0;
+    std::atomic<long long int> atomic_total_amount = 0;
+
+    // totals of the bill list this bill is registered to, updated together with the bill
+    std::atomic<SalesAggregates *> aggregates = nullptr;
+
+    // set once no more products will be added, the bill list may then compact it away
+    std::atomic<bool> closed = false;
 
 public:
+    BasicBill()
+    {
+        this->object_lock.describe(BILL_SITE, 0);
+    }
+
+    /// @brief Creates a lock-free bill for products with ids in [1, product_count]
+    explicit BasicBill(int product_count) : counters{new std::atomic<int>[product_count + 1]}, counter_count{product_count + 1}
+    {
+        this->object_lock.describe(BILL_SITE, 0);
+
+        for (int index = 0; index < counter_count; ++index)
+            this->counters[index].store(0, std::memory_order_relaxed);
+    }
+
+    bool isLockFree()
+    {
+        return this->counters != nullptr;
+    }
+
+    /// @brief Makes the bill report its current and future products to `aggregates`.
+    /// Lock-free bills must be attached before their first addProductAtomic().
+    void attach(SalesAggregates *aggregates)
+    {
+        if (this->isLockFree())
+        {
+            this->aggregates.store(aggregates, std::memory_order_release);
+            return;
+        }
+
+        this->object_lock.lock();
+
+        for (const auto &[id, line] : this->products)
+            aggregates->recordSale(id, line.quantity, line.amount);
+
+        this->aggregates.store(aggregates, std::memory_order_relaxed);
+
+        this->object_lock.unlock();
+    }
+
+    /// @brief Marks the bill as complete. Nothing may be added to it afterwards.
+    void close()
+    {
+        this->closed.store(true, std::memory_order_release);
+    }
+
+    bool isClosed()
+    {
+        return this->closed.load(std::memory_order_acquire);
+    }
+
+    /// @brief Calls `visit(id, quantity, amount)` for every product of a bill that is not lock-free
+    template <typename F>
+    void forEachLine(F &&visit)
+    {
+        this->object_lock.lock();
+
+        for (const auto &[id, line] : this->products)
+            visit(id, line.quantity, line.amount);
+
+        this->object_lock.unlock();
+    }
+
     std::map<int, int> getBills()
     {
+        std::map<int, int> result;
+
+        if (this->isLockFree())
+        {
+            for (int id = 0; id < this->counter_count; ++id)
+            {
+                int quantity = this->counters[id].load(std::memory_order_acquire);
+                if (quantity != 0)
+                    result[id] = quantity;
+            }
+
+            return result;
+        }
+
         this->object_lock.lock();
 
-        auto result = this->products;
+        for (const auto &[id, line] : this->products)
+            result[id] = line.quantity;
 
         this->object_lock.unlock();
 
@@ -148,36 +663,85 @@ public:
     }
 
     void addProduct(int id, int quantity, int price)
+    {
+        long long int amount = (long long int)quantity * price;
+
+        this->object_lock.lock();
+
+        BillLine &line = this->products[id];
+        line.quantity += quantity;
+        line.amount += amount;
+
+        this->total_amount += amount;
+
+        SalesAggregates *aggregates = this->aggregates.load(std::memory_order_relaxed);
+        if (aggregates != nullptr)
+            aggregates->recordSale(id, quantity, amount);
+
+        this->object_lock.unlock();
+    }
+
+    /// @brief Adds several products under one acquisition of the bill lock
+    void addProducts(const std::vector<SaleLine> &lines)
     {
         this->object_lock.lock();
 
-        if (this->products.count(id) == 1)
-            this->products[id] += quantity;
-        else
-            this->products[id] = quantity;
+        SalesAggregates *aggregates = this->aggregates.load(std::memory_order_relaxed);
 
-        this->total_amount += price;
+        for (const SaleLine &sale : lines)
+        {
+            long long int amount = (long long int)sale.quantity * sale.price;
+
+            BillLine &line = this->products[sale.id];
+            line.quantity += sale.quantity;
+            line.amount += amount;
+
+            this->total_amount += amount;
+
+            if (aggregates != nullptr)
+                aggregates->recordSale(sale.id, sale.quantity, amount);
+        }
 
         this->object_lock.unlock();
     }
 
+    /// @brief Lock-free version of addProduct(), only for bills created with BasicBill(product_count)
+    void addProductAtomic(int id, int quantity, int price)
+    {
+        long long int amount = (long long int)quantity * price;
+
+        this->counters[id].fetch_add(quantity, std::memory_order_release);
+        this->atomic_total_amount.fetch_add(amount, std::memory_order_release);
+
+        SalesAggregates *aggregates = this->aggregates.load(std::memory_order_relaxed);
+        if (aggregates != nullptr)
+            aggregates->recordSale(id, quantity, amount);
+    }
+
     int getQuantityFor(int id)
     {
         int result = 0;
 
+        if (this->isLockFree())
+            return id >= 0 && id < this->counter_count ? this->counters[id].load(std::memory_order_acquire) : 0;
+
         this->object_lock.lock();
 
-        if (this->products.count(id) == 1)
-            result = this->products[id];
+        auto line = this->products.find(id);
+        if (line != this->products.end())
+            result = line->second.quantity;
 
         this->object_lock.unlock();
 
         return result;
     }
 
-    int getTotal()
+    long long int getTotal()
     {
-        int result = 0;
+        long long int result = 0;
+
+        if (this->isLockFree())
+            return this->atomic_total_amount.load(std::memory_order_acquire);
 
         this->object_lock.lock();
 
@@ -189,51 +753,424 @@ public:
     }
 };
 
-class BillList
+/// @brief One line item of a journaled bill
+struct JournalRecord
+{
+    int bill_id;
+    int product_id;
+    int quantity;
+    int price;
+};
+
+/// @brief Append-only bill journal owned by a single sale thread. Line items are written into fixed-size chunks without
+/// taking any lock; readers only look at the records below the published watermark, so they never see a half-written one.
+class BillJournal
+{
+private:
+    static constexpr int CHUNK_RECORDS = 4096;
+
+    struct Chunk
+    {
+        JournalRecord records[CHUNK_RECORDS];
+        std::atomic<Chunk *> next = nullptr;
+    };
+
+    Chunk *head;
+
+    // only used by the owning thread
+    Chunk *tail;
+    int tail_used = 0;
+    int last_bill_id = 0;
+    int current_bill_id = 0;
+
+    // number of records readers may look at, published after each record is complete
+    std::atomic<long long int> published = 0;
+
+    std::atomic<SalesAggregates *> aggregates = nullptr;
+
+public:
+    BillJournal() : head{new Chunk()}, tail{head} {}
+
+    BillJournal(const BillJournal &) = delete;
+    BillJournal &operator=(const BillJournal &) = delete;
+
+    ~BillJournal()
+    {
+        while (this->head != nullptr)
+        {
+            Chunk *next = this->head->next.load(std::memory_order_relaxed);
+            delete this->head;
+            this->head = next;
+        }
+    }
+
+    /// @brief Makes the journal report its lines to `aggregates`, must be called before the first append()
+    void attach(SalesAggregates *aggregates)
+    {
+        this->aggregates.store(aggregates, std::memory_order_release);
+    }
+
+    /// @brief Starts a new bill, the following lines belong to it. Owning thread only.
+    int openBill()
+    {
+        this->current_bill_id = ++this->last_bill_id;
+        return this->current_bill_id;
+    }
+
+    /// @brief Adds a line to the current bill. Owning thread only, allocates once every CHUNK_RECORDS lines.
+    void append(int product_id, int quantity, int price)
+    {
+        if (this->tail_used == CHUNK_RECORDS)
+        {
+            Chunk *chunk = new Chunk();
+            this->tail->next.store(chunk, std::memory_order_release);
+            this->tail = chunk;
+            this->tail_used = 0;
+        }
+
+        this->tail->records[this->tail_used++] = JournalRecord{this->current_bill_id, product_id, quantity, price};
+
+        SalesAggregates *aggregates = this->aggregates.load(std::memory_order_relaxed);
+        if (aggregates != nullptr)
+            aggregates->recordSale(product_id, quantity, (long long int)quantity * price);
+
+        this->published.store(this->published.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    long long int getPublishedCount()
+    {
+        return this->published.load(std::memory_order_acquire);
+    }
+
+    /// @brief Calls `visit` for every published record, in the order they were appended. Safe while the owner appends.
+    template <typename F>
+    void forEach(F &&visit)
+    {
+        long long int count = this->getPublishedCount();
+        Chunk *chunk = this->head;
+
+        for (long long int index = 0; index < count; ++index)
+        {
+            if (index > 0 && index % CHUNK_RECORDS == 0)
+                chunk = chunk->next.load(std::memory_order_acquire);
+
+            visit(chunk->records[index % CHUNK_RECORDS]);
+        }
+    }
+};
+
+/// @brief Per-product totals of a run of compacted bills, ordered by product id
+struct BillSegment
+{
+    std::vector<std::pair<int, long long int>> quantities;
+    long long int amount = 0;
+    long long int bill_count = 0;
+
+    void merge(const BillSegment &other)
+    {
+        std::vector<std::pair<int, long long int>> merged;
+        merged.reserve(this->quantities.size() + other.quantities.size());
+
+        auto left = this->quantities.cbegin(), right = other.quantities.cbegin();
+        while (left != this->quantities.cend() || right != other.quantities.cend())
+        {
+            if (right == other.quantities.cend() || (left != this->quantities.cend() && left->first < right->first))
+                merged.push_back(*left++);
+            else if (left == this->quantities.cend() || right->first < left->first)
+                merged.push_back(*right++);
+            else merged.push_back({left->first, (left++)->second + (right++)->second});
+        }
+
+        this->quantities = std::move(merged);
+        this->amount += other.amount;
+        this->bill_count += other.bill_count;
+    }
+};
+
+template <typename Policy>
+class BasicBillList
 {
 private:
-    std::mutex object_lock;
-    std::vector<std::shared_ptr<Bill>> bills;
+    typename Policy::ObjectLock object_lock;
+    std::vector<std::shared_ptr<BasicBill<Policy>>> bills;
+    std::vector<std::shared_ptr<BillJournal>> journals;
+    SalesAggregates aggregates;
+
+    // held through a whole compaction, so audit() never sees bills that left `bills` but are not in a segment yet
+    std::mutex compaction_lock;
+    std::vector<BillSegment> segments;
+    size_t max_segments;
+    std::shared_ptr<BillArchive> archive;
+    long long int compacted_bills = 0;
 
 public:
-    void registerBill(std::shared_ptr<Bill> bill)
+    /// @brief Creates an empty list for products with ids in [1, product_count]
+    /// @param archive File keeping the lines of compacted bills, or nullptr to drop them
+    /// @param max_segments Number of summary segments above which compact() merges them
+    explicit BasicBillList(int product_count, std::shared_ptr<BillArchive> archive = nullptr, size_t max_segments = 8)
+        : aggregates{product_count}, max_segments{std::max<size_t>(max_segments, 1)}, archive{archive}
+    {
+        this->object_lock.describe(BILL_LIST_SITE, 0);
+    }
+
+    void registerBill(std::shared_ptr<BasicBill<Policy>> bill)
     {
         object_lock.lock();
 
         bills.push_back(bill);
+        bill->attach(&aggregates);
 
         object_lock.unlock();
     }
 
-    long long int getTotalQuantityFor(int id)
+    /// @brief Registers the journal of a sale thread, before the thread appends to it
+    void registerJournal(std::shared_ptr<BillJournal> journal)
     {
-        long long int total = 0;
+        object_lock.lock();
+
+        journals.push_back(journal);
+        journal->attach(&aggregates);
+
+        object_lock.unlock();
+    }
+
+    /// @brief Rolls the closed bills into a summary segment and drops them, archiving their lines first if the list has an archive.
+    /// Lock-free bills are left alone, there is only one per sale thread. Safe to run while sales are running.
+    /// @return Number of bills compacted
+    long long int compact()
+    {
+        std::lock_guard<std::mutex> guard(this->compaction_lock);
+        std::vector<std::shared_ptr<BasicBill<Policy>>> closed;
 
         object_lock.lock();
 
-        for (const auto &bill : bills)
+        auto open_end = std::stable_partition(bills.begin(), bills.end(), [](const std::shared_ptr<BasicBill<Policy>> &bill)
+                                              { return bill->isLockFree() || !bill->isClosed(); });
+        closed.assign(std::make_move_iterator(open_end), std::make_move_iterator(bills.end()));
+        bills.erase(open_end, bills.end());
+
+        object_lock.unlock();
+
+        if (closed.empty())
+            return 0;
+
+        std::map<int, long long int> quantities;
+        std::vector<ArchivedBillLine> lines;
+        BillSegment segment;
+
+        for (const auto &bill : closed)
+        {
+            long long int bill_number = this->compacted_bills++;
+
+            bill->forEachLine([&](int id, int quantity, long long int amount)
+            {
+                quantities[id] += quantity;
+                if (this->archive != nullptr)
+                    lines.push_back({bill_number, id, quantity, amount});
+            });
+
+            segment.amount += bill->getTotal();
+        }
+
+        if (this->archive != nullptr)
+            this->archive->append(lines);
+
+        segment.quantities.assign(quantities.begin(), quantities.end());
+        segment.bill_count = closed.size();
+        long long int compacted = segment.bill_count;
+        closed.clear();
+
+        this->segments.push_back(std::move(segment));
+        while (this->segments.size() > this->max_segments)
         {
-            total += bill->getQuantityFor(id);
+            this->segments[this->segments.size() - 2].merge(this->segments.back());
+            this->segments.pop_back();
         }
 
+        return compacted;
+    }
+
+    /// @brief Records sales made before the process started as a summary segment, so they count for the totals and the audit.
+    /// Only for a list no sale has used yet. Takes the lock once for all the products.
+    /// @param read Called with every index in [0, count) to get the id, quantity and amount of one product, in ascending id order
+    template <typename F>
+    void restoreSales(int count, F &&read)
+    {
+        std::lock_guard<std::mutex> guard(this->compaction_lock);
+
+        if (this->segments.empty())
+            this->segments.emplace_back();
+
+        BillSegment &segment = this->segments.back();
+        segment.quantities.reserve(segment.quantities.size() + count);
+
+        for (int index = 0; index < count; ++index)
+        {
+            int id;
+            long long int quantity, amount;
+            read(index, id, quantity, amount);
+
+            segment.quantities.push_back({id, quantity});
+            segment.amount += amount;
+            aggregates.restoreSale(id, quantity, amount);
+        }
+    }
+
+    /// @brief Bills still held in full by the list
+    size_t getLiveBillCount()
+    {
+        object_lock.lock();
+        size_t count = bills.size();
         object_lock.unlock();
 
-        return total;
+        return count;
+    }
+
+    long long int getCompactedBillCount()
+    {
+        std::lock_guard<std::mutex> guard(this->compaction_lock);
+        return this->compacted_bills;
+    }
+
+    size_t getSegmentCount()
+    {
+        std::lock_guard<std::mutex> guard(this->compaction_lock);
+        return this->segments.size();
+    }
+
+    /// @brief Quantity sold for a product over all registered bills, O(1)
+    long long int getTotalQuantityFor(int id)
+    {
+        return aggregates.getQuantityFor(id);
+    }
+
+    /// @brief Money made with a product over all registered bills, O(1)
+    long long int getTotalAmountFor(int id)
+    {
+        return aggregates.getAmountFor(id);
     }
 
+    /// @brief Value of all registered bills, O(products)
     long long int getTotalAmount()
     {
+        return aggregates.getTotalAmount();
+    }
+
+    /// @brief Checks that the archived lines of the compacted bills add up to the summary segments, and that a lookup by number
+    /// finds the lines the archive holds for the last archived bill. Sales restored with restoreSales() have no archived lines,
+    /// so this is only meaningful for a list that never restored any.
+    /// @param product_id Set to the first product whose quantity does not match, or to 0 if only the value or the lookup differs
+    /// @return true if the archive matches the segments, or if the list has no archive
+    bool auditArchive(int &product_id)
+    {
+        std::lock_guard<std::mutex> guard(this->compaction_lock);
+        product_id = 0;
+
+        if (this->archive == nullptr)
+            return true;
+
+        int product_count = aggregates.getProductCount();
+        std::vector<long long int> quantities(product_count + 1, 0);
         long long int total = 0;
+        std::vector<ArchivedBillLine> last_bill;
+
+        this->archive->forEach([&](const ArchivedBillLine &line)
+        {
+            quantities[line.product_id] += line.quantity;
+            total += line.amount;
+
+            if (!last_bill.empty() && last_bill.back().bill_number != line.bill_number)
+                last_bill.clear();
+            last_bill.push_back(line);
+        });
+
+        for (const BillSegment &segment : segments)
+        {
+            for (const auto &[id, quantity] : segment.quantities)
+                quantities[id] -= quantity;
+
+            total -= segment.amount;
+        }
+
+        for (int id = 0; id <= product_count; ++id)
+        {
+            if (quantities[id] != 0)
+            {
+                product_id = id;
+                return false;
+            }
+        }
+
+        if (total != 0)
+            return false;
+
+        if (last_bill.empty())
+            return true;
+
+        std::vector<ArchivedBillLine> found = this->archive->findBill(last_bill.back().bill_number);
+        return std::equal(found.begin(), found.end(), last_bill.begin(), last_bill.end(), [](const ArchivedBillLine &first, const ArchivedBillLine &second)
+        {
+            return first.bill_number == second.bill_number && first.product_id == second.product_id && first.quantity == second.quantity &&
+                   first.amount == second.amount;
+        });
+    }
+
+    /// @brief Recomputes the totals from the raw bills, the summary segments of the compacted ones and the journals, and compares them
+    /// with the running ones. Only exact while no sale is running.
+    /// @param product_id Set to the first product whose quantity does not match, or to 0 if only the total value differs
+    /// @return true if the running totals match the bills
+    bool audit(int &product_id)
+    {
+        int product_count = aggregates.getProductCount();
+        std::vector<long long int> quantities(product_count + 1, 0);
+        long long int total = 0;
+
+        std::lock_guard<std::mutex> guard(this->compaction_lock);
+
+        for (const BillSegment &segment : segments)
+        {
+            for (const auto &[id, quantity] : segment.quantities)
+                quantities[id] += quantity;
+
+            total += segment.amount;
+        }
 
         object_lock.lock();
 
         for (const auto &bill : bills)
         {
+            for (const auto &[id, quantity] : bill->getBills())
+                quantities[id] += quantity;
+
             total += bill->getTotal();
         }
 
+        for (const auto &journal : journals)
+        {
+            journal->forEach([&](const JournalRecord &record)
+            {
+                quantities[record.product_id] += record.quantity;
+                total += (long long int)record.quantity * record.price;
+            });
+        }
+
         object_lock.unlock();
 
-        return total;
+        for (int id = 0; id <= product_count; ++id)
+        {
+            if (quantities[id] != aggregates.getQuantityFor(id))
+            {
+                product_id = id;
+                return false;
+            }
+        }
+
+        product_id = 0;
+        return total == aggregates.getTotalAmount();
     }
 };
+
+using Product = BasicProduct<MutexPolicy>;
+using ProductTable = BasicProductTable<MutexPolicy>;
+using Bill = BasicBill<MutexPolicy>;
+using BillList = BasicBillList<MutexPolicy>;
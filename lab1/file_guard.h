@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/// @brief Closes a file descriptor when it goes out of scope, so a failed check never leaks it
+struct FileGuard
+{
+    int file;
+
+    /// @brief Keeps the file open past the guard, the caller closes it
+    int release()
+    {
+        int file = this->file;
+        this->file = -1;
+        return file;
+    }
+
+    ~FileGuard()
+    {
+        if (this->file >= 0)
+            close(this->file);
+    }
+};
+
+/// @brief Unmaps a mapping when it goes out of scope, like FileGuard
+struct MappingGuard
+{
+    void *memory;
+    size_t bytes;
+
+    void *release()
+    {
+        void *memory = this->memory;
+        this->memory = MAP_FAILED;
+        return memory;
+    }
+
+    ~MappingGuard()
+    {
+        if (this->memory != MAP_FAILED)
+            munmap(this->memory, this->bytes);
+    }
+};
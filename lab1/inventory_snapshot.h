@@ -0,0 +1,199 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "file_guard.h"
+
+// Binary inventory snapshot: a header, one fixed-size record per product in id order, then the product names back to back.
+// The file is written to a temporary path and renamed over the old one, so a crash never leaves a half-written snapshot behind.
+// Loading maps the file and reads the records in place: nothing is parsed, the checksum is the only pass before the products are set up,
+// and the product names are used straight from the mapping.
+
+/// @brief One product as stored in a snapshot
+struct SnapshotProduct
+{
+    int32_t id;
+    int32_t price;
+    int32_t quantity;
+    int32_t initial_quantity;
+
+    // totals of the bills referring to the product
+    int64_t sold_quantity;
+    int64_t sold_amount;
+
+    // name position in the name area following the records
+    uint32_t name_offset;
+    uint32_t name_length;
+};
+
+struct SnapshotHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t product_count;
+
+    // bank account total at the cut
+    int64_t money;
+    uint64_t name_bytes;
+
+    // word-wise FNV-1a of the product records and the names
+    uint64_t checksum;
+};
+
+/// @brief Read-only view of a snapshot file mapped in memory
+class InventorySnapshot
+{
+private:
+    static constexpr uint64_t MAGIC = 0x50414e5331424c41ULL;
+    static constexpr uint32_t VERSION = 1;
+
+    const char *memory = nullptr;
+    size_t bytes = 0;
+
+    static void check(bool ok, const std::string &what)
+    {
+        if (!ok)
+            throw std::runtime_error("InventorySnapshot: " + what + ": " + std::strerror(errno));
+    }
+
+    /// @brief FNV-1a over 8-byte words, with the bytes of the last partial word folded in one by one
+    static uint64_t hash(uint64_t seed, const void *data, size_t size)
+    {
+        const unsigned char *bytes = (const unsigned char *)data;
+        size_t index = 0;
+
+        for (; index + sizeof(uint64_t) <= size; index += sizeof(uint64_t))
+        {
+            uint64_t word;
+            std::memcpy(&word, bytes + index, sizeof(word));
+            seed = (seed ^ word) * 1099511628211ULL;
+        }
+
+        for (; index < size; ++index)
+            seed = (seed ^ bytes[index]) * 1099511628211ULL;
+
+        return seed;
+    }
+
+    static uint64_t checksum(const SnapshotProduct *products, size_t product_count, const char *names, size_t name_bytes)
+    {
+        uint64_t seed = hash(1469598103934665603ULL, products, product_count * sizeof(SnapshotProduct));
+        return hash(seed, names, name_bytes);
+    }
+
+    static void writeAll(int file, const void *data, size_t size, const std::string &path)
+    {
+        const char *cursor = (const char *)data;
+
+        while (size > 0)
+        {
+            ssize_t written = ::write(file, cursor, size);
+            check(written > 0, "write " + path);
+            cursor += written;
+            size -= written;
+        }
+    }
+
+    const SnapshotHeader &header() const
+    {
+        return *(const SnapshotHeader *)this->memory;
+    }
+
+    const char *names() const
+    {
+        return this->memory + sizeof(SnapshotHeader) + this->header().product_count * sizeof(SnapshotProduct);
+    }
+
+public:
+    /// @brief Maps and validates the snapshot at `path`
+    explicit InventorySnapshot(const std::string &path)
+    {
+        void *mapped;
+        {
+            FileGuard file{open(path.c_str(), O_RDONLY)};
+            check(file.file >= 0, "open " + path);
+
+            struct stat info;
+            check(fstat(file.file, &info) == 0, "fstat " + path);
+            this->bytes = info.st_size;
+
+            if (this->bytes < sizeof(SnapshotHeader))
+                throw std::runtime_error("InventorySnapshot: " + path + " is too short");
+
+            mapped = mmap(nullptr, this->bytes, PROT_READ, MAP_PRIVATE, file.file, 0);
+        }
+
+        check(mapped != MAP_FAILED, "mmap " + path);
+        this->memory = (const char *)mapped;
+
+        const SnapshotHeader &header = this->header();
+        size_t expected = sizeof(SnapshotHeader) + (size_t)header.product_count * sizeof(SnapshotProduct) + header.name_bytes;
+
+        if (header.magic != MAGIC || header.version != VERSION || expected != this->bytes ||
+            checksum(this->products(), header.product_count, this->names(), header.name_bytes) != header.checksum)
+        {
+            munmap((void *)this->memory, this->bytes);
+            throw std::runtime_error("InventorySnapshot: " + path + " is not a valid snapshot");
+        }
+    }
+
+    InventorySnapshot(const InventorySnapshot &) = delete;
+    InventorySnapshot &operator=(const InventorySnapshot &) = delete;
+
+    ~InventorySnapshot()
+    {
+        munmap((void *)this->memory, this->bytes);
+    }
+
+    int getProductCount() const
+    {
+        return this->header().product_count;
+    }
+
+    long long int getMoney() const
+    {
+        return this->header().money;
+    }
+
+    /// @brief Records of all the products, in id order
+    const SnapshotProduct *products() const
+    {
+        return (const SnapshotProduct *)(this->memory + sizeof(SnapshotHeader));
+    }
+
+    std::string_view name(const SnapshotProduct &product) const
+    {
+        return std::string_view(this->names() + product.name_offset, product.name_length);
+    }
+
+    /// @brief Writes a snapshot of the given products, whose name offsets point into `names`, and bank account total
+    static void write(const std::string &path, const std::vector<SnapshotProduct> &products, const std::string &names, long long int money)
+    {
+        SnapshotHeader header{MAGIC, VERSION, (uint32_t)products.size(), money, names.size(),
+                              checksum(products.data(), products.size(), names.data(), names.size())};
+
+        std::string temporary = path + ".tmp";
+        {
+            FileGuard file{open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+            check(file.file >= 0, "open " + temporary);
+
+            writeAll(file.file, &header, sizeof(header), temporary);
+            writeAll(file.file, products.data(), products.size() * sizeof(SnapshotProduct), temporary);
+            writeAll(file.file, names.data(), names.size(), temporary);
+
+            check(fsync(file.file) == 0, "fsync " + temporary);
+        }
+
+        check(std::rename(temporary.c_str(), path.c_str()) == 0, "rename " + temporary);
+    }
+};
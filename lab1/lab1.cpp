@@ -3,7 +3,23 @@
 #include <utility>
 #include <cstdlib>
 #include <ctime>
+#include <atomic>
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <sstream>
+#include <type_traits>
+#include <iomanip>
 #include "entities.h"
+#include "durable_journal.h"
+#include "workload.h"
+#include "partitioned_shop.h"
+#include "thread_pool.h"
+#include "inventory_snapshot.h"
+#include "leaderboard.h"
+#include "operation_trace.h"
+#include "virtual_clients.h"
+#include "reservations.h"
 
 using namespace std;
 
@@ -17,6 +33,20 @@ bool debugPrint = false;
 // randomise number of operations: THREAD_OPERATIONS * rand(1, 5)
 #define THREAD_RANDOMIZE_COUNT false
 
+// distribution of the product ids picked by the sale and basket threads: UNIFORM_KEYS, ZIPF_KEYS or HOTSPOT_KEYS, see workload.h
+#define WORKLOAD_KEY_DISTRIBUTION UNIFORM_KEYS
+#define WORKLOAD_ZIPF_SKEW 0.99
+
+// share of the products that are hot and share of the operations going to them, for HOTSPOT_KEYS
+#define WORKLOAD_HOTSPOT_FRACTION 0.01
+#define WORKLOAD_HOTSPOT_PROBABILITY 0.9
+
+// percentage of the sale thread operations that are sales, the others only read a product
+#define WORKLOAD_SALE_PERCENT 100
+
+// seed of the first sale thread, the others use the next seeds
+#define WORKLOAD_SEED 1
+
 // delay between each integrity check
 #define INTEGRITY_CHECK_DELAY_MS 10
 
@@ -26,6 +56,327 @@ bool debugPrint = false;
 // run the slower integrity check method
 #define SLOW_CHECK false
 
+// run the non-blocking snapshot check while sales are running (ignored if SLOW_CHECK is set)
+#define SNAPSHOT_CHECK true
+
+// passes over the products that changed mid-read before the snapshot check locks them
+#define SNAPSHOT_MAX_RETRIES 16
+
+// split inventoryCheck over a thread pool, AUDIT_RANGE_SIZE products per task
+#define PARALLEL_CHECK true
+#define AUDIT_RANGE_SIZE 1024
+
+// workers of the audit pool, 0 for one per core
+#define AUDIT_THREAD_COUNT 0
+
+// time the sequential and the parallel inventory check against each other
+#define RUN_AUDIT_BENCHMARK true
+#define AUDIT_BENCHMARK_ROUNDS 10
+
+// cross-validate the running bill totals against the raw bills in the slow check and after all sales are done
+#define AUDIT_CHECK true
+
+// roll closed bills into summary segments in the background, so the bill list does not keep every basket bill forever
+#define BILL_COMPACTION true
+#define BILL_COMPACTION_INTERVAL_MS 20
+
+// file keeping the lines of compacted bills, empty to drop them; every run replaces it, so it holds the bills of the last run only
+#define BILL_ARCHIVE_PATH "lab1_bill_archive.bin"
+
+// summary segments kept before compaction merges them
+#define BILL_MAX_SEGMENTS 8
+
+// sale modes to benchmark, each one runs on a fresh set of products
+#define RUN_MUTEX_MODE true
+#define RUN_LOCK_FREE_MODE true
+#define RUN_JOURNAL_MODE true
+#define RUN_DURABLE_MODE true
+#define RUN_BATCH_MODE true
+
+// sales queued by a thread of the batch mode before they are sold together
+#define SALE_BATCH_SIZE 32
+
+// on-disk journal written by the durable mode
+#define JOURNAL_DIRECTORY "lab1_journal"
+#define JOURNAL_SEGMENT_RECORDS (1 << 20)
+
+// FSYNC_NONE, FSYNC_INTERVAL or FSYNC_GROUP_COMMIT, see durable_journal.h
+#define JOURNAL_FSYNC_POLICY FSYNC_INTERVAL
+#define JOURNAL_FSYNC_INTERVAL_MS 5
+
+// rebuild products and bills from JOURNAL_DIRECTORY and check them before running the benchmarks
+#define RECOVER_FROM_JOURNAL false
+
+// binary snapshot of products, bill totals and money, written while the mutex mode runs
+#define WRITE_INVENTORY_SNAPSHOT true
+#define INVENTORY_SNAPSHOT_PATH "lab1_inventory.snap"
+#define INVENTORY_SNAPSHOT_DELAY_MS 50
+
+// load INVENTORY_SNAPSHOT_PATH once the sale modes are done, check it and compare its load time with getProducts()
+#define RESTORE_FROM_INVENTORY_SNAPSHOT true
+
+// run the mutex mode once more with a best-seller leaderboard kept up to date by every sale, reported as a run of its own,
+// and check the leaderboard against the bills afterwards; the other runs never feed a leaderboard
+#define RUN_LEADERBOARD true
+
+// time between two leaderboard merges, the staleness bound of its answers
+#define LEADERBOARD_MERGE_INTERVAL_MS 10
+
+// largest top-N the leaderboard answers, and N printed in the report
+#define LEADERBOARD_CAPACITY 100
+#define LEADERBOARD_TOP 5
+
+// sales every sale thread can queue for the leaderboard between two merges
+#define LEADERBOARD_RING_CAPACITY (1 << 14)
+
+// record the operations of every thread of the mutex-mode run to OPERATION_TRACE_PATH
+#define RECORD_OPERATION_TRACE true
+#define OPERATION_TRACE_PATH "lab1_operations.trace"
+
+// replay OPERATION_TRACE_PATH under every sale mode and lock policy, so they all run exactly the same operations
+#define RUN_TRACE_REPLAY true
+
+// checkout threads reserving stock, paying and then committing, cancelling or walking away, next to mutex-mode sale threads
+#define RUN_RESERVATION_MODE true
+#define RESERVATION_CHECKOUT_THREADS 8
+#define RESERVATION_SALE_THREADS 8
+#define RESERVATION_OPERATIONS 100000
+
+// time a checkout spends paying while holding its reservation, and the time after which a reservation expires
+#define RESERVATION_PAYMENT_NS 2000
+#define RESERVATION_TTL_MS 20
+
+// share of the checkouts cancelled, and of the ones left to expire
+#define RESERVATION_CANCEL_PERCENT 10
+#define RESERVATION_ABANDON_PERCENT 5
+
+// reservation slots and timer wheel, see StockReservations
+#define RESERVATION_CAPACITY (1 << 17)
+#define RESERVATION_WHEEL_SIZE 256
+#define RESERVATION_TICK_MS 1
+
+// simulate clients as coroutines resumed by a few worker threads, once for every client count of VIRTUAL_CLIENT_COUNTS
+#define RUN_VIRTUAL_CLIENT_SWEEP true
+#define VIRTUAL_CLIENT_COUNTS {16, 256, 4096, 32768}
+
+// worker threads resuming the clients, 0 for one per core
+#define VIRTUAL_CLIENT_WORKERS 0
+
+// operations of a run, shared out evenly between its clients
+#define VIRTUAL_CLIENT_OPERATIONS 2000000
+
+// operations a client runs before it yields to the other ready clients. Between yields a client only goes through the
+// scheduler's ready queue when it was suspended on a product lock, so the sweep measures lock suspensions, not the queue.
+#define VIRTUAL_CLIENT_YIELD_BATCH 64
+
+// run the mutex-mode workload under every lock policy of locks.h
+#define RUN_LOCK_POLICY_SWEEP true
+
+// thread counts of the lock policy sweep
+#define LOCK_POLICY_THREAD_COUNTS {1, 4, 16}
+
+// stripe counts of the striped lock policy, from one lock for all products to many
+#define LOCK_STRIPE_COUNTS 1, 16, 256
+
+// time one sale out of every LATENCY_SAMPLE_RATE for the latency percentiles
+#define LATENCY_SAMPLE_RATE 16
+
+// basket sales: every operation sells several distinct products under one bill
+#define RUN_BASKET_SWEEP true
+
+// baskets sold by every thread in the basket sweep
+#define BASKET_OPERATIONS 20000
+
+// basket sizes and thread counts of the basket sweep
+#define BASKET_SIZES {1, 2, 4, 8}
+#define BASKET_THREAD_COUNTS {1, 4, 16}
+
+// upper bound of the exponential backoff when a basket fails to take all its locks or to validate, in thread yields
+#define BASKET_MAX_BACKOFF 1024
+
+// run the ordered and optimistic basket sweeps once with uniform and once with Zipf keys, to compare their abort rates
+#define RUN_BASKET_SKEW_SWEEP true
+
+// run the sales on a PartitionedShop too, where owner threads hold the products and sale threads send them requests
+#define RUN_PARTITIONED_MODE true
+
+// owner threads of the partitioned mode, and capacity of every sale thread to owner queue
+#define PARTITION_COUNT 4
+#define PARTITION_QUEUE_CAPACITY 1024
+
+// pin every owner thread to its own core
+#define PARTITION_PIN_THREADS true
+
+// run the basket sweep on the partitioned shop too, baskets spanning partitions are sold with two-phase commit
+#define RUN_PARTITIONED_BASKET_SWEEP true
+
+// wrap the locks of the sale modes and basket sweeps in ProfiledLock and print a contention report at the end
+#define LOCK_PROFILING false
+
+// file the contention report is also written to as CSV, empty to skip it
+#define LOCK_PROFILE_CSV "lab1_lock_profile.csv"
+
+// number of most contended products listed in the report
+#define LOCK_PROFILE_TOP_PRODUCTS 10
+
+// lock policy of the sale modes and basket sweeps, profiled only when LOCK_PROFILING is set so the plain build pays nothing
+using ShopPolicy = conditional_t<LOCK_PROFILING, ProfiledPolicy<MutexPolicy>, MutexPolicy>;
+
+enum SaleMode
+{
+    // every sale locks its product
+    MUTEX_MODE,
+    // quantity, money and bills are updated with atomic operations, no locks on the sale path
+    LOCK_FREE_MODE,
+    // every sale locks its product, bills are appended to a per-thread journal instead of a Bill
+    JOURNAL_MODE,
+    // journal mode, with every sale also appended to the on-disk journal
+    DURABLE_MODE,
+    // sales are queued and sold SALE_BATCH_SIZE at a time, see sellBatch()
+    BATCH_MODE
+};
+
+enum BasketLocking
+{
+    // lock the products of the basket in ascending id order
+    ORDERED_LOCKING,
+    // try to lock every product, release everything and back off if one of them is taken
+    TRY_LOCK_BACKOFF,
+    // read the products without locking, then lock only the ones that change while validating their versions, see sellBasketOptimistic()
+    OPTIMISTIC_LOCKING
+};
+
+string basketLockingName(BasketLocking locking)
+{
+    switch (locking)
+    {
+    case ORDERED_LOCKING:
+        return "ordered";
+    case TRY_LOCK_BACKOFF:
+        return "try-lock/backoff";
+    case OPTIMISTIC_LOCKING:
+        return "optimistic";
+    }
+
+    return "unknown";
+}
+
+string keyDistributionName(const WorkloadConfig &config)
+{
+    ostringstream skew;
+    skew << config.zipf_skew;
+
+    switch (config.distribution)
+    {
+    case UNIFORM_KEYS:
+        return "uniform";
+    case ZIPF_KEYS:
+        return "zipf(" + skew.str() + ")";
+    case HOTSPOT_KEYS:
+        return "hotspot";
+    }
+
+    return "unknown";
+}
+
+/// @brief What a sale thread did, for the benchmark report
+struct SaleStats
+{
+    long long int operations = 0;
+
+    // sampled sale latencies, in nanoseconds
+    vector<long long int> latencies;
+};
+
+/// @brief Sale waiting in a SaleBatch
+struct PendingSale
+{
+    int product_id;
+    int quantity;
+};
+
+/// @brief Sales queued by one thread, with the scratch space sellBatch() needs to sell them
+template <typename Policy>
+struct SaleBatch
+{
+    vector<PendingSale> sales;
+
+    // distinct products of the batch and their bill lines in id order, and the same products in lock order
+    vector<BasicProduct<Policy> *> products;
+    vector<SaleLine> lines;
+    vector<BasicProduct<Policy> *> locked;
+};
+
+/// @brief Throughput and tail latency of one benchmark run
+struct SaleResult
+{
+    string name;
+    int thread_count;
+    long long int elapsed_ms;
+    long long int operations;
+    long long int p50_ns, p99_ns, p999_ns;
+
+    string toString()
+    {
+        return name + ", " + to_string(thread_count) + " threads: " + to_string(elapsed_ms) + "ms, " +
+               to_string(operations * 1000 / max(elapsed_ms, 1LL)) + " ops/s, latency p50 " + to_string(p50_ns) +
+               "ns, p99 " + to_string(p99_ns) + "ns, p99.9 " + to_string(p999_ns) + "ns";
+    }
+};
+
+WorkloadConfig workloadConfig()
+{
+    WorkloadConfig config;
+    config.distribution = WORKLOAD_KEY_DISTRIBUTION;
+    config.zipf_skew = WORKLOAD_ZIPF_SKEW;
+    config.hotspot_fraction = WORKLOAD_HOTSPOT_FRACTION;
+    config.hotspot_probability = WORKLOAD_HOTSPOT_PROBABILITY;
+    config.sale_percent = WORKLOAD_SALE_PERCENT;
+    return config;
+}
+
+/// @brief Merges the statistics of all sale threads of a run
+SaleResult summarizeSales(string name, vector<SaleStats> &stats, long long int elapsed_ms)
+{
+    SaleResult result{name, (int)stats.size(), elapsed_ms, 0, 0, 0, 0};
+    vector<long long int> latencies;
+
+    for (SaleStats &thread_stats : stats)
+    {
+        result.operations += thread_stats.operations;
+        latencies.insert(latencies.end(), thread_stats.latencies.begin(), thread_stats.latencies.end());
+    }
+
+    if (!latencies.empty())
+    {
+        sort(latencies.begin(), latencies.end());
+        result.p50_ns = latencies[latencies.size() * 50 / 100];
+        result.p99_ns = latencies[latencies.size() * 99 / 100];
+        result.p999_ns = latencies[latencies.size() * 999 / 1000];
+    }
+
+    return result;
+}
+
+string saleModeName(SaleMode mode)
+{
+    switch (mode)
+    {
+    case MUTEX_MODE:
+        return "mutex";
+    case LOCK_FREE_MODE:
+        return "lock-free";
+    case JOURNAL_MODE:
+        return "journal";
+    case DURABLE_MODE:
+        return "durable";
+    case BATCH_MODE:
+        return "batch";
+    }
+
+    return "unknown";
+}
+
 // Asynchronous output https://stackoverflow.com/a/45046349
 struct Acout
 {
@@ -49,27 +400,164 @@ struct Acout
     }
 } acout;
 
+/// @brief Sorts products by the lock they use, so that everyone locking several products takes the shared locks in one global order.
+/// With one lock per product this is the id order of the product table.
+template <typename Policy>
+void sortByLock(vector<BasicProduct<Policy> *> &products)
+{
+    sort(products.begin(), products.end(), [](BasicProduct<Policy> *first, BasicProduct<Policy> *second)
+         { return less<const void *>()(first->lockIdentity(), second->lockIdentity()); });
+}
+
+/// @brief True if the product at `index` uses the same lock as the one before it (products sorted with sortByLock)
+template <typename Policy>
+bool sharesPreviousLock(vector<BasicProduct<Policy> *> &products, size_t index)
+{
+    return index > 0 && products[index]->lockIdentity() == products[index - 1]->lockIdentity();
+}
+
+/// @brief Tries to lock all the products, keeping none of them locked on failure
+template <typename Policy>
+bool tryLockBasket(vector<BasicProduct<Policy> *> &products)
+{
+    for (size_t index = 0; index < products.size(); ++index)
+    {
+        if (!sharesPreviousLock(products, index) && !products[index]->tryLock())
+        {
+            for (size_t locked = 0; locked < index; ++locked)
+                if (!sharesPreviousLock(products, locked))
+                    products[locked]->unlock();
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// @brief Locks all the products of a basket, which must be sorted with sortByLock. Ordered locking relies on that order,
+/// so two baskets always take their common locks in the same order; try-lock/backoff never waits while holding a lock.
+/// Products sharing a lock are locked once.
+/// @return Number of times try-lock/backoff had to release everything and start over
+template <typename Policy>
+int lockBasket(vector<BasicProduct<Policy> *> &products, BasketLocking locking)
+{
+    if (locking != TRY_LOCK_BACKOFF)
+    {
+        for (size_t index = 0; index < products.size(); ++index)
+            if (!sharesPreviousLock(products, index))
+                products[index]->lock();
+        return 0;
+    }
+
+    int backoff = 1, retries = 0;
+    while (!tryLockBasket(products))
+    {
+        ++retries;
+        for (int index = 0; index < backoff; ++index)
+            this_thread::yield();
+
+        backoff = min(backoff * 2, BASKET_MAX_BACKOFF);
+    }
+
+    return retries;
+}
+
+template <typename Policy>
+void unlockBasket(vector<BasicProduct<Policy> *> &products)
+{
+    for (size_t index = 0; index < products.size(); ++index)
+        if (!sharesPreviousLock(products, index))
+            products[index]->unlock();
+}
+
+/// @brief Checks that the money in the bank account is justified by the registered bills. Both are read at the same point,
+/// between sales, through ShopBankAccount::getTotalConsistent.
+template <typename Policy>
+bool moneyCheck(shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
+{
+    long long int moneyFromBills = 0;
+    long long int moneyFromAccount = shop_account->getTotalConsistent([&]
+        { moneyFromBills = bills->getTotalAmount(); });
+
+    if (moneyFromAccount != moneyFromBills)
+    {
+        acout << "==============================================\n";
+        acout << "  Consistency check failed\n";
+        acout << "  Bank account amount: " << moneyFromAccount << "\n";
+        acout << "  Bill amount: " << moneyFromBills << "\n";
+        acout << "==============================================\n";
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief Recomputes the bill totals from the raw bills and compares them with the running ones kept by the bill list.
+/// Walks every bill, so it is only run while no sale can change them.
+template <typename Policy>
+bool auditCheck(shared_ptr<BasicBillList<Policy>> bills)
+{
+    int id;
+
+    if (!bills->audit(id))
+    {
+        acout << "==============================================\n";
+        acout << "  Bill audit failed\n";
+        if (id != 0)
+            acout << "  Product ID: " << id << "\n";
+        else acout << "  Total bill amount differs\n";
+        acout << "==============================================\n";
+        return false;
+    }
 
-/// @brief Runs an inventory check to make sure current data is consistent with all registered bills.
-/// @param product_database Database of products, pair of id & associated product
+    return true;
+}
+
+/// @brief Checks the bill archive against the summary segments once the last compaction is done
+template <typename Policy>
+bool archiveCheck(shared_ptr<BasicBillList<Policy>> bills)
+{
+    int id;
+
+    if (!bills->auditArchive(id))
+    {
+        acout << "==============================================\n";
+        acout << "  Bill archive check failed\n";
+        if (id != 0)
+            acout << "  Product ID: " << id << "\n";
+        else acout << "  Archived amount or bill lookup differs\n";
+        acout << "==============================================\n";
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief Runs an inventory check to make sure current data is consistent with all registered bills, on the calling thread.
+/// @param product_database Database of products, indexed by id
 /// @param bills List with all the bills
-void inventoryCheck(map<int, shared_ptr<Product>> &product_database, shared_ptr<BillList> bills)
+/// @param shop_account Bank account, its total must match the value of all the bills
+template <typename Policy>
+void inventoryCheckSequential(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
 {
     long long int moneyFromDatabase = 0, moneyFromBills = 0;
 
-    for (const auto &[id, val] : product_database)
+    for (BasicProduct<Policy> &product : product_database)
     {
+        int id = product.getId();
+
         // lock operations for this product while performing the check
-        val->lock();
+        product.lock();
 
-        int quantity_db, price = val->getPrice();
-        quantity_db = val->getInitialQuantity() - val->getQuantity();
+        int quantity_db, price = product.getPrice();
+        quantity_db = product.getSoldQuantity();
         moneyFromDatabase = price * quantity_db;
 
         int quantity_bills = bills->getTotalQuantityFor(id);
         moneyFromBills = price * quantity_bills;
 
-        val->unlock();
+        product.unlock();
 
         if (moneyFromDatabase != moneyFromBills)
         {
@@ -85,27 +573,153 @@ void inventoryCheck(map<int, shared_ptr<Product>> &product_database, shared_ptr<
         }
     }
 
+    if (!moneyCheck(bills, shop_account))
+        return;
+
+    if(debugPrint) {
+        acout << "==============================================\n";
+        acout << "      Consistency check is successful\n";
+        acout << "==============================================\n";
+    }else acout << "    - - - - Consistency check is successful - - - -\n";
+}
+
+/// @brief Pool shared by every parallel inventory check, started on first use
+ThreadPool &auditPool()
+{
+    static ThreadPool pool(AUDIT_THREAD_COUNT > 0 ? AUDIT_THREAD_COUNT : thread::hardware_concurrency());
+    return pool;
+}
+
+/// @brief What the parallel inventory check found in one range of products
+struct AuditRange
+{
+    long long int moneyFromDatabase = 0, moneyFromBills = 0;
+
+    // first inconsistent product of the range, 0 if there is none
+    int failed_id = 0;
+    int quantity_db = 0, quantity_bills = 0;
+    long long int amount_db = 0, amount_bills = 0;
+};
+
+/// @brief Same check as inventoryCheckSequential, with the products split into ranges of AUDIT_RANGE_SIZE checked on the audit pool.
+/// Every range sums the money of its products from the database and from the bill totals and keeps its first inconsistent product;
+/// the ranges are reduced in id order, so the product reported is the lowest inconsistent id, as with the sequential check, and
+/// the reduced sums must match too.
+template <typename Policy>
+void inventoryCheckParallel(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
+{
+    int size = product_database.size();
+    int range_count = (size + AUDIT_RANGE_SIZE - 1) / AUDIT_RANGE_SIZE;
+    vector<AuditRange> ranges(range_count);
+
+    auditPool().parallelFor(range_count, [&](int range_index)
+    {
+        AuditRange &range = ranges[range_index];
+        int last = min(size, (range_index + 1) * AUDIT_RANGE_SIZE);
+
+        for (int id = range_index * AUDIT_RANGE_SIZE + 1; id <= last; ++id)
+        {
+            BasicProduct<Policy> &product = product_database[id];
+
+            product.lock();
+
+            int price = product.getPrice();
+            int quantity_db = product.getSoldQuantity();
+            int quantity_bills = bills->getTotalQuantityFor(id);
+            long long int amount_bills = bills->getTotalAmountFor(id);
+
+            product.unlock();
+
+            long long int amount_db = (long long int)price * quantity_db;
+            range.moneyFromDatabase += amount_db;
+            range.moneyFromBills += amount_bills;
+
+            if (quantity_db != quantity_bills || amount_db != amount_bills)
+            {
+                range.failed_id = id;
+                range.quantity_db = quantity_db;
+                range.quantity_bills = quantity_bills;
+                range.amount_db = amount_db;
+                range.amount_bills = amount_bills;
+                return;
+            }
+        }
+    });
+
+    long long int moneyFromDatabase = 0, moneyFromBills = 0;
+
+    for (AuditRange &range : ranges)
+    {
+        if (range.failed_id != 0)
+        {
+            acout << "==============================================\n";
+            acout << "  Consistency check failed\n";
+            acout << "  Product ID: " << range.failed_id << "\n";
+            acout << "  Database quantity: " << range.quantity_db << "\n";
+            acout << "  Bill quantity: " << range.quantity_bills << "\n";
+            acout << "  Database amount: " << range.amount_db << "\n";
+            acout << "  Bill amount: " << range.amount_bills << "\n";
+            acout << "==============================================\n";
+            return;
+        }
+
+        moneyFromDatabase += range.moneyFromDatabase;
+        moneyFromBills += range.moneyFromBills;
+    }
+
+    if (moneyFromDatabase != moneyFromBills)
+    {
+        acout << "==============================================\n";
+        acout << "  Consistency check failed\n";
+        acout << "  Database amount: " << moneyFromDatabase << "\n";
+        acout << "  Bill amount: " << moneyFromBills << "\n";
+        acout << "==============================================\n";
+        return;
+    }
+
+    if (!moneyCheck(bills, shop_account))
+        return;
+
     if(debugPrint) {
         acout << "==============================================\n";
         acout << "      Consistency check is successful\n";
+        acout << "  Database amount: " << moneyFromDatabase << ", bill amount: " << moneyFromBills << ", " << range_count << " ranges\n";
         acout << "==============================================\n";
     }else acout << "    - - - - Consistency check is successful - - - -\n";
 }
 
+/// @brief Runs an inventory check to make sure current data is consistent with all registered bills, on the audit pool if PARALLEL_CHECK is set.
+template <typename Policy>
+void inventoryCheck(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
+{
+    if (PARALLEL_CHECK)
+        inventoryCheckParallel(product_database, bills, shop_account);
+    else inventoryCheckSequential(product_database, bills, shop_account);
+}
+
 /// @brief Runs an inventory check to make sure current data is consistent with all registered bills. (slower version - locks all data first, then checks)
-/// @param product_database Database of products, pair of id & associated product
+/// @param product_database Database of products, indexed by id
 /// @param bills List with all the bills
-void inventoryCheckSlow(map<int, shared_ptr<Product>> &product_database, shared_ptr<BillList> bills)
+/// @param shop_account Bank account, its total must match the value of all the bills
+template <typename Policy>
+void inventoryCheckSlow(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
 {
     long long int moneyFromDatabase = 0, moneyFromBills = 0;
+    vector<BasicProduct<Policy> *> products;
+
+    for (BasicProduct<Policy> &product : product_database)
+        products.push_back(&product);
+
+    sortByLock(products);
+    lockBasket(products, ORDERED_LOCKING);
 
-    for (const auto &[id, val] : product_database)
-        val->lock();
+    bool consistent = true;
 
-    for (const auto &[id, val] : product_database)
+    for (BasicProduct<Policy> &product : product_database)
     {
-        int quantity_db, price = val->getPrice();
-        quantity_db = val->getInitialQuantity() - val->getQuantity();
+        int id = product.getId();
+        int quantity_db, price = product.getPrice();
+        quantity_db = product.getSoldQuantity();
         moneyFromDatabase = price * quantity_db;
 
         int quantity_bills = bills->getTotalQuantityFor(id);
@@ -121,138 +735,1758 @@ void inventoryCheckSlow(map<int, shared_ptr<Product>> &product_database, shared_
             acout << "  Database amount: " << moneyFromDatabase << "\n";
             acout << "  Bill amount: " << moneyFromBills << "\n";
             acout << "==============================================\n";
-            return;
+            consistent = false;
+            break;
         }
     }
 
-    for (const auto &[id, val] : product_database)
-        val->unlock();
+    if (consistent)
+        consistent = moneyCheck(bills, shop_account);
+
+    if (consistent && AUDIT_CHECK)
+        consistent = auditCheck(bills);
+
+    unlockBasket(products);
+
+    if (!consistent)
+        return;
 
     acout << "==============================================\n";
     acout << "      Consistency check is successful\n";
     acout << "==============================================\n";
 }
 
-/// @brief Method for thread to run an inventory check.
-/// @param product_database Database of products, pair of id & associated product
-/// @param bills List with all the bills
-/// @param still_executing Thread will keep checking the data until this variable is set to false by the main thread.
-void inventoryCheckThread(map<int, shared_ptr<Product>> &product_database, shared_ptr<BillList> bills, bool &still_executing)
+/// @brief Reads the quantity sold for a product from the database and from the bills without locking it.
+/// @return false if a sale changed the product during the read
+template <typename Policy>
+bool readProductSnapshot(BasicProduct<Policy> &product, shared_ptr<BasicBillList<Policy>> bills, int &quantity_db, int &quantity_bills)
 {
-    void (*inventoryCheckFunc)(map<int, shared_ptr<Product>>&, shared_ptr<BillList>);
+    unsigned int version = product.readBegin();
 
-    if(SLOW_CHECK)
-        inventoryCheckFunc = inventoryCheckSlow;
-    else inventoryCheckFunc = inventoryCheck;
+    quantity_db = product.getSoldQuantity();
+    quantity_bills = bills->getTotalQuantityFor(product.getId());
 
-    while (still_executing)
-    {
-        this_thread::sleep_for(chrono::milliseconds(INTEGRITY_CHECK_DELAY_MS));
-        inventoryCheckFunc(ref(product_database), bills);
-    }
+    return product.readValid(version);
 }
 
-/// @brief Method for threads that run sale operations. Will do THREAD_OPERATIONS * rand(1, 5) transactions until shutdown, buying a random number of a product for each transaction. 
-/// @param product_database Database of products, pair of id & associated product
+/// @brief Runs an inventory check without blocking sales. Every product is read under its seqlock; the products that
+/// a sale changed mid-read are collected and re-read in later passes, and only those still changing after
+/// SNAPSHOT_MAX_RETRIES passes are locked. The money check is skipped if no sale-free point is found quickly.
+/// @param product_database Database of products, indexed by id
 /// @param bills List with all the bills
-/// @param shop_account Does nothing
-/// @param seed Seed used for random number generation
-void threadWork(map<int, shared_ptr<Product>> const &product_database, shared_ptr<BillList> bills, shared_ptr<ShopBankAccount> shop_account, int seed)
+/// @param shop_account Bank account, its total must match the value of all the bills
+template <typename Policy>
+void inventoryCheckSnapshot(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
 {
-    auto tid = this_thread::get_id();
-    acout << "[T" << tid << "] " << "Starting execution\n";
-    srand(seed);
-
-    int size = product_database.size();
-    int key, count;
-    Product *product;
-    int amount;
+    vector<int> changed, still_changed;
+    int quantity_db, quantity_bills, retries = 0;
 
-    shared_ptr<Bill> bill(new Bill());
-    bills->registerBill(bill);
-
-    if(debugPrint)
-        acout << "[T" << tid << "] " << "Will be purchasing products " << count << " times\n";
-    
-    if(THREAD_RANDOMIZE_COUNT)
-        count = THREAD_OPERATIONS * (rand() % 5 + 1);
-    else count = THREAD_OPERATIONS;
+    auto report = [&](int id)
+    {
+        acout << "==============================================\n";
+        acout << "  Consistency check failed\n";
+        acout << "  Product ID: " << id << "\n";
+        acout << "  Database quantity: " << quantity_db << "\n";
+        acout << "  Bill quantity: " << quantity_bills << "\n";
+        acout << "==============================================\n";
+    };
 
-    while (count > 0)
+    for (BasicProduct<Policy> &product : product_database)
     {
-        count--;
-        key = rand() % size + 1;
+        int id = product.getId();
+        if (!readProductSnapshot(product, bills, quantity_db, quantity_bills))
+            changed.push_back(id);
+        else if (quantity_db != quantity_bills)
+            return report(id);
+    }
 
-        product = product_database.at(key).get();
+    for (int pass = 0; pass < SNAPSHOT_MAX_RETRIES && !changed.empty(); ++pass)
+    {
+        this_thread::yield();
+        retries += changed.size();
+        still_changed.clear();
 
-        product->lock();
-        amount = product->purchase(rand() % 100 + 1);
-        shop_account->registerTransaction(amount * product->getPrice());
-        bill->addProduct(key, amount, product->getPrice());
-        product->unlock();
+        for (int id : changed)
+        {
+            if (!readProductSnapshot(product_database[id], bills, quantity_db, quantity_bills))
+                still_changed.push_back(id);
+            else if (quantity_db != quantity_bills)
+                return report(id);
+        }
 
-        if(debugPrint)
-            acout << "[T" << tid << "] " << "Purchased " << amount << " of product " << key << "\n";
+        swap(changed, still_changed);
     }
 
-    acout << "[T" << tid << "] Finished execution\n";
-}
+    for (int id : changed)
+    {
+        BasicProduct<Policy> &product = product_database[id];
 
-/// @brief Method for generating test data
-map<int, shared_ptr<Product>> getProducts()
-{
-    map<int, shared_ptr<Product>> map;
+        product.lock();
+        readProductSnapshot(product, bills, quantity_db, quantity_bills);
+        product.unlock();
 
-    for (int index = 1; index < PRODUCT_COUNT + 1; ++index)
-        map.insert(pair(
-            index,
-            shared_ptr<Product>(new Product(index, rand() % 100 + 1, 100 * index, "Product" + to_string(index)))));
+        if (quantity_db != quantity_bills)
+            return report(id);
+    }
 
-    return map;
-}
+    long long int moneyFromAccount, moneyFromBills = 0;
+    bool money_checked = shop_account->tryGetTotalConsistent(moneyFromAccount, [&]
+        { moneyFromBills = bills->getTotalAmount(); }, SNAPSHOT_MAX_RETRIES);
 
-int main()
-{
-    acout << "Main thread " << this_thread::get_id() << "\n";
+    if (money_checked && moneyFromAccount != moneyFromBills)
+    {
+        acout << "==============================================\n";
+        acout << "  Consistency check failed\n";
+        acout << "  Bank account amount: " << moneyFromAccount << "\n";
+        acout << "  Bill amount: " << moneyFromBills << "\n";
+        acout << "==============================================\n";
+        return;
+    }
 
-    bool still_executing = true;
-    vector<thread> children;
+    if(debugPrint) {
+        acout << "==============================================\n";
+        acout << "      Consistency check is successful\n";
+        acout << "  Re-read products: " << retries << ", locked: " << changed.size() << "\n";
+        if (!money_checked)
+            acout << "  Money check skipped, no point without running sales found\n";
+        acout << "==============================================\n";
+    }else acout << "    - - - - Consistency check is successful - - - -\n";
+}
+
+/// @brief Runs an inventory check without locking any product or holding back any sale, used by the lock-free sale mode.
+/// A lock-free sale takes the stock and the money first and records them on the bill afterwards, so the bills are read before
+/// the product and the account: while sales are running the bills can only lag behind, once they are finished both must match exactly.
+/// @param product_database Database of products, indexed by id
+/// @param bills List with all the bills
+/// @param shop_account Bank account, its total must match the value of all the bills
+template <typename Policy>
+void inventoryCheckLockFree(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account, bool exact)
+{
+    for (BasicProduct<Policy> &product : product_database)
+    {
+        int id = product.getId();
+        int quantity_bills = bills->getTotalQuantityFor(id);
+        int quantity_db = product.getSoldQuantity();
+
+        if (quantity_bills > quantity_db || (exact && quantity_bills != quantity_db))
+        {
+            acout << "==============================================\n";
+            acout << "  Consistency check failed\n";
+            acout << "  Product ID: " << id << "\n";
+            acout << "  Database quantity: " << quantity_db << "\n";
+            acout << "  Bill quantity: " << quantity_bills << "\n";
+            acout << "==============================================\n";
+            return;
+        }
+    }
+
+    // lock-free sales never call beginSale(), so getTotalConsistent() would find no sale-free point to read at
+    long long int moneyFromBills = bills->getTotalAmount();
+    long long int moneyFromAccount = shop_account->getTotal();
+
+    if (moneyFromBills > moneyFromAccount || (exact && moneyFromBills != moneyFromAccount))
+    {
+        acout << "==============================================\n";
+        acout << "  Consistency check failed\n";
+        acout << "  Bank account amount: " << moneyFromAccount << "\n";
+        acout << "  Bill amount: " << moneyFromBills << "\n";
+        acout << "==============================================\n";
+        return;
+    }
+
+    if(debugPrint) {
+        acout << "==============================================\n";
+        acout << "      Consistency check is successful\n";
+        acout << "==============================================\n";
+    }else acout << "    - - - - Consistency check is successful - - - -\n";
+}
+
+template <typename Policy>
+void inventoryCheckLockFreeRunning(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
+{
+    inventoryCheckLockFree(product_database, bills, shop_account, false);
+}
+
+/// @brief Method for thread to run an inventory check.
+/// @param product_database Database of products, indexed by id
+/// @param bills List with all the bills
+/// @param shop_account Bank account of the shop
+/// @param still_executing Thread will keep checking the data until this variable is set to false by the main thread.
+/// @param mode Sale mode used by the sale threads
+template <typename Policy>
+void inventoryCheckThread(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account, atomic_bool &still_executing, SaleMode mode)
+{
+    void (*inventoryCheckFunc)(BasicProductTable<Policy>&, shared_ptr<BasicBillList<Policy>>, shared_ptr<ShopBankAccount>);
+
+    if(mode == LOCK_FREE_MODE)
+        inventoryCheckFunc = inventoryCheckLockFreeRunning<Policy>;
+    else if(SLOW_CHECK)
+        inventoryCheckFunc = inventoryCheckSlow<Policy>;
+    else if(SNAPSHOT_CHECK)
+        inventoryCheckFunc = inventoryCheckSnapshot<Policy>;
+    else inventoryCheckFunc = inventoryCheck<Policy>;
+
+    while (still_executing)
+    {
+        this_thread::sleep_for(chrono::milliseconds(INTEGRITY_CHECK_DELAY_MS));
+        inventoryCheckFunc(product_database, bills, shop_account);
+    }
+}
+
+/// @brief Reads the price and stock of a product without locking it, retrying while a sale changes it
+/// @return Value of the remaining stock
+template <typename Policy>
+long long int browseProduct(BasicProduct<Policy> &product)
+{
+    unsigned int version;
+    long long int value;
+
+    do
+    {
+        version = product.readBegin();
+        value = (long long int)product.getQuantity() * product.getPrice();
+    } while (!product.readValid(version));
+
+    return value;
+}
+
+/// @brief Sells all the sales queued in `batch` and empties it. Sales of the same product are bought with one purchase, the products
+/// of the batch are locked once each, in lock order, and the bill and the bank account get one update for the whole batch.
+/// A sale still gets what it would have got on its own: the units bought for a product are its queued quantities clamped to the stock.
+/// @return Units sold
+template <typename Policy>
+int sellBatch(BasicProductTable<Policy> &product_database, BasicBill<Policy> &bill, ShopBankAccount &shop_account, SaleBatch<Policy> &batch)
+{
+    vector<PendingSale> &sales = batch.sales;
+    int sold = 0, total = 0;
+
+    sort(sales.begin(), sales.end(), [](const PendingSale &first, const PendingSale &second)
+         { return first.product_id < second.product_id; });
+
+    batch.products.clear();
+    batch.lines.clear();
+
+    for (size_t index = 0; index < sales.size(); ++index)
+    {
+        if (index == 0 || sales[index].product_id != sales[index - 1].product_id)
+        {
+            BasicProduct<Policy> *product = &product_database[sales[index].product_id];
+            batch.products.push_back(product);
+            batch.lines.push_back({product->getId(), 0, product->getPrice()});
+        }
+
+        batch.lines.back().quantity += sales[index].quantity;
+    }
+
+    batch.locked = batch.products;
+    sortByLock(batch.locked);
+    lockBasket(batch.locked, ORDERED_LOCKING);
+    shop_account.beginSale<Policy>();
+
+    for (BasicProduct<Policy> *product : batch.products)
+        product->beginWrite();
+
+    for (size_t index = 0; index < batch.lines.size(); ++index)
+    {
+        SaleLine &line = batch.lines[index];
+        line.quantity = batch.products[index]->purchase(line.quantity);
+        sold += line.quantity;
+        total += line.quantity * line.price;
+    }
+
+    bill.addProducts(batch.lines);
+    shop_account.registerTransaction(total);
+
+    for (BasicProduct<Policy> *product : batch.products)
+        product->endWrite();
+
+    shop_account.endSale();
+    unlockBasket(batch.locked);
+
+    sales.clear();
+    return sold;
+}
+
+/// @brief Method for threads that run sale operations. Will do THREAD_OPERATIONS * rand(1, 5) operations until shutdown, each one either
+/// buying a random number of a product or browsing it, with products and operations drawn from `workload` or replayed from `trace`.
+/// @param product_database Database of products, indexed by id
+/// @param bills List with all the bills
+/// @param shop_account Bank account receiving the money of each sale
+/// @param workload Key distribution and operation mix of the run
+/// @param seed Seed of the thread's generator
+/// @param mode MUTEX_MODE locks the product for every sale, LOCK_FREE_MODE uses the atomic purchase path instead,
+/// JOURNAL_MODE locks the product and records the sale in the thread's bill journal, DURABLE_MODE also writes it to `durable_journal`,
+/// BATCH_MODE queues the sales and sells them SALE_BATCH_SIZE at a time with sellBatch()
+/// @param durable_journal On-disk journal, only used by DURABLE_MODE
+/// @param leaderboard Leaderboard every sale is reported to, or nullptr
+/// @param trace Stream of the thread in an operation trace, or nullptr. Replayed instead of drawing from `workload` if `replay` is set, recorded otherwise.
+/// @param stats Receives the number of sales and sampled sale latencies
+template <typename Policy>
+void threadWork(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account,
+                const Workload &workload, uint64_t seed, SaleMode mode, shared_ptr<DurableJournal> durable_journal, shared_ptr<Leaderboard> leaderboard,
+                vector<TraceOperation> *trace, bool replay, SaleStats &stats)
+{
+    auto tid = this_thread::get_id();
+    acout << "[T" << tid << "] " << "Starting execution\n";
+    WorkloadGenerator generator(workload, seed);
+
+    int size = product_database.size();
+    int key, count, quantity;
+    BasicProduct<Policy> *product;
+    int amount;
+    size_t position = 0;
+
+    shared_ptr<BasicBill<Policy>> bill;
+    shared_ptr<BillJournal> journal;
+    uint64_t bill_key = 0;
+    long long int sequence = 0;
+    SaleBatch<Policy> batch;
+    shared_ptr<LeaderboardDeltas> deltas;
+
+    if (leaderboard != nullptr)
+        deltas = leaderboard->registerWriter();
+
+    auto recordBatch = [&]
+    {
+        if (deltas != nullptr)
+            for (const SaleLine &line : batch.lines)
+                if (line.quantity > 0)
+                    deltas->record(line.id, line.quantity, (long long int)line.quantity * line.price);
+    };
+
+    if (mode == JOURNAL_MODE || mode == DURABLE_MODE)
+    {
+        journal = make_shared<BillJournal>();
+        bills->registerJournal(journal);
+        int bill_id = journal->openBill();
+
+        if (mode == DURABLE_MODE)
+            bill_key = DurableJournal::billKey(durable_journal->registerWriter(), bill_id);
+    }
+    else
+    {
+        bill = shared_ptr<BasicBill<Policy>>(mode == LOCK_FREE_MODE ? new BasicBill<Policy>(size) : new BasicBill<Policy>());
+        bills->registerBill(bill);
+    }
+
+    if(debugPrint)
+        acout << "[T" << tid << "] " << "Will be purchasing products " << count << " times\n";
+    
+    if (replay)
+        count = trace->size();
+    else if(THREAD_RANDOMIZE_COUNT)
+        count = THREAD_OPERATIONS * generator.nextInt(1, 5);
+    else count = THREAD_OPERATIONS;
+
+    stats.operations = count;
+
+    if (trace != nullptr && !replay)
+        trace->reserve(count);
+
+    while (count > 0)
+    {
+        count--;
+
+        if (replay)
+        {
+            TraceOperation operation = (*trace)[position++];
+            key = operation.getProductId();
+            quantity = operation.getQuantity();
+        }
+        else
+        {
+            key = generator.nextKey();
+            quantity = generator.nextOperation() == BROWSE_OPERATION ? 0 : generator.nextInt(1, 100);
+
+            if (trace != nullptr)
+                trace->push_back(TraceOperation(key, quantity));
+        }
+
+        product = &product_database[key];
+
+        bool sampled = count % LATENCY_SAMPLE_RATE == 0;
+        chrono::steady_clock::time_point sale_start;
+        if (sampled)
+            sale_start = chrono::steady_clock::now();
+
+        if (quantity == 0)
+        {
+            browseProduct(*product);
+            amount = 0;
+        }
+        else if (mode == BATCH_MODE)
+        {
+            batch.sales.push_back({key, quantity});
+            amount = 0;
+
+            if ((int)batch.sales.size() == SALE_BATCH_SIZE)
+            {
+                amount = sellBatch(product_database, *bill, *shop_account, batch);
+                recordBatch();
+            }
+        }
+        else if (mode == LOCK_FREE_MODE)
+        {
+            // money before the bill, inventoryCheckLockFree relies on the bills never getting ahead of the account
+            amount = product->purchaseAtomic(quantity);
+            shop_account->registerTransaction(amount * product->getPrice());
+            bill->addProductAtomic(key, amount, product->getPrice());
+        }
+        else
+        {
+            product->lock();
+            shop_account->beginSale<Policy>();
+            product->beginWrite();
+            amount = product->purchase(quantity);
+            shop_account->registerTransaction(amount * product->getPrice());
+
+            if (mode == DURABLE_MODE)
+                sequence = durable_journal->append(bill_key, key, amount, product->getPrice());
+
+            if (mode == JOURNAL_MODE || mode == DURABLE_MODE)
+                journal->append(key, amount, product->getPrice());
+            else bill->addProduct(key, amount, product->getPrice());
+
+            product->endWrite();
+            shop_account->endSale();
+            product->unlock();
+
+            // wait for the disk outside of the product lock
+            if (mode == DURABLE_MODE)
+                durable_journal->commit(sequence);
+        }
+
+        if (sampled)
+            stats.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sale_start).count());
+
+        if (deltas != nullptr && mode != BATCH_MODE && amount > 0)
+            deltas->record(key, amount, (long long int)amount * product->getPrice());
+
+        if(debugPrint)
+            acout << "[T" << tid << "] " << "Purchased " << amount << " of product " << key << "\n";
+    }
+
+    if (!batch.sales.empty())
+    {
+        sellBatch(product_database, *bill, *shop_account, batch);
+        recordBatch();
+    }
+
+    if (bill != nullptr)
+        bill->close();
+
+    acout << "[T" << tid << "] Finished execution\n";
+}
+
+/// @brief Picks `basket_size` distinct product ids from the workload's key distribution, sorted ascending
+vector<int> randomBasket(WorkloadGenerator &generator, int basket_size)
+{
+    vector<int> basket;
+
+    while ((int)basket.size() < basket_size)
+    {
+        int key = generator.nextKey();
+        if (find(basket.begin(), basket.end(), key) == basket.end())
+            basket.push_back(key);
+    }
+
+    sort(basket.begin(), basket.end());
+    return basket;
+}
+
+/// @brief Sells a basket with optimistic concurrency control. The products, in id order, are read under their seqlock versions
+/// and the units to buy are worked out without any lock. Only the products whose stock changes are then locked, every version
+/// read is validated, and the writes are applied only if nothing changed in between; otherwise the attempt aborts, backs off and
+/// starts over from the read.
+/// @param amounts Units asked for each product
+/// @param versions, bought, changed Scratch space of the calling thread
+/// @return Number of aborted attempts
+template <typename Policy>
+int sellBasketOptimistic(vector<BasicProduct<Policy> *> &products, const vector<int> &amounts, BasicBillList<Policy> &bills, ShopBankAccount &shop_account,
+                         vector<unsigned int> &versions, vector<int> &bought, vector<BasicProduct<Policy> *> &changed)
+{
+    size_t count = products.size();
+    int aborts = 0, backoff = 1;
+
+    versions.resize(count);
+    bought.resize(count);
+
+    while (true)
+    {
+        bool valid = true;
+        changed.clear();
+
+        for (size_t index = 0; index < count && valid; ++index)
+        {
+            versions[index] = products[index]->readBegin();
+            bought[index] = min(amounts[index], products[index]->getQuantity());
+            valid = (versions[index] & 1) == 0;
+
+            if (bought[index] > 0)
+                changed.push_back(products[index]);
+        }
+
+        if (valid)
+        {
+            sortByLock(changed);
+            lockBasket(changed, ORDERED_LOCKING);
+
+            // a locked product can not change anymore, the others were only read and must simply be unchanged
+            for (size_t index = 0; index < count && valid; ++index)
+                valid = products[index]->readValid(versions[index]);
+
+            if (valid)
+                break;
+
+            unlockBasket(changed);
+        }
+
+        ++aborts;
+        for (int index = 0; index < backoff; ++index)
+            this_thread::yield();
+
+        backoff = min(backoff * 2, BASKET_MAX_BACKOFF);
+    }
+
+    shared_ptr<BasicBill<Policy>> bill(new BasicBill<Policy>());
+    int total = 0;
+
+    shop_account.beginSale<Policy>();
+
+    for (BasicProduct<Policy> *product : changed)
+        product->beginWrite();
+
+    // a reservation may still have taken units since the validation, it does not need the product lock
+    for (size_t index = 0; index < count; ++index)
+    {
+        BasicProduct<Policy> *product = products[index];
+        bought[index] = product->purchase(bought[index]);
+        total += bought[index] * product->getPrice();
+        bill->addProduct(product->getId(), bought[index], product->getPrice());
+    }
+
+    shop_account.registerTransaction(total);
+    bills.registerBill(bill);
+    bill->close();
+
+    for (BasicProduct<Policy> *product : changed)
+        product->endWrite();
+
+    shop_account.endSale();
+    unlockBasket(changed);
+
+    return aborts;
+}
+
+/// @brief Method for threads that run basket sales. Every operation buys a random number of `basket_size` distinct products
+/// atomically: all of them are locked while the basket gets its own bill, which is registered before the locks are released.
+/// OPTIMISTIC_LOCKING sells the basket with sellBasketOptimistic() instead.
+/// @param product_database Database of products, indexed by id
+/// @param bills List with all the bills
+/// @param shop_account Bank account receiving the money of each basket
+/// @param workload Key distribution of the run, its operation mix is ignored
+/// @param seed Seed of the thread's generator
+/// @param basket_size Number of distinct products in each basket
+/// @param locking Protocol used to lock the products of a basket
+/// @param retries Receives the number of times a basket had to start over, try-lock/backoff failures or optimistic aborts
+template <typename Policy>
+void basketWork(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account,
+                const Workload &workload, uint64_t seed, int basket_size, BasketLocking locking, long long int &retries)
+{
+    WorkloadGenerator generator(workload, seed);
+    vector<BasicProduct<Policy> *> products, changed;
+    vector<int> amounts(basket_size), bought;
+    vector<unsigned int> versions;
+
+    for (int count = 0; count < BASKET_OPERATIONS; ++count)
+    {
+        vector<int> basket = randomBasket(generator, basket_size);
+
+        products.clear();
+        for (int key : basket)
+            products.push_back(&product_database[key]);
+
+        if (locking == OPTIMISTIC_LOCKING)
+        {
+            for (int &amount : amounts)
+                amount = generator.nextInt(1, 100);
+
+            retries += sellBasketOptimistic(products, amounts, *bills, *shop_account, versions, bought, changed);
+            continue;
+        }
+
+        sortByLock(products);
+
+        shared_ptr<BasicBill<Policy>> bill(new BasicBill<Policy>());
+        int total = 0;
+
+        retries += lockBasket(products, locking);
+        shop_account->beginSale<Policy>();
+
+        for (BasicProduct<Policy> *product : products)
+            product->beginWrite();
+
+        for (BasicProduct<Policy> *product : products)
+        {
+            int amount = product->purchase(generator.nextInt(1, 100));
+            total += amount * product->getPrice();
+            bill->addProduct(product->getId(), amount, product->getPrice());
+        }
+
+        shop_account->registerTransaction(total);
+        bills->registerBill(bill);
+        bill->close();
+
+        for (BasicProduct<Policy> *product : products)
+            product->endWrite();
+
+        shop_account->endSale();
+        unlockBasket(products);
+    }
+}
+
+/// @brief Method for the thread compacting the closed bills every BILL_COMPACTION_INTERVAL_MS
+/// @param still_executing Thread will keep compacting until this variable is set to false by the main thread.
+template <typename Policy>
+void billCompactionThread(shared_ptr<BasicBillList<Policy>> bills, atomic_bool &still_executing)
+{
+    while (still_executing)
+    {
+        this_thread::sleep_for(chrono::milliseconds(BILL_COMPACTION_INTERVAL_MS));
+        bills->compact();
+    }
+}
+
+/// @brief Creates the bill list of a run, archiving compacted bills to BILL_ARCHIVE_PATH if compaction is on.
+/// The archive is recreated for every list, wiping the bills of the previous run, so only one such list may be alive at a time.
+template <typename Policy>
+shared_ptr<BasicBillList<Policy>> makeBillList(int product_count)
+{
+    shared_ptr<BillArchive> archive;
+    if (BILL_COMPACTION && string(BILL_ARCHIVE_PATH) != "")
+        archive = make_shared<BillArchive>(BILL_ARCHIVE_PATH);
+
+    return make_shared<BasicBillList<Policy>>(product_count, archive, BILL_MAX_SEGMENTS);
+}
+
+/// @brief Method for generating test data. Prices come from a fixed seed, so every run and journal recovery sees the same products.
+template <typename Policy>
+BasicProductTable<Policy> getProducts()
+{
+    BasicProductTable<Policy> table(PRODUCT_COUNT);
+    mt19937 generator(1);
+    uniform_int_distribution<int> price(1, 100);
+
+    for (int index = 1; index < PRODUCT_COUNT + 1; ++index)
+        table.setProduct(index, price(generator), 100 * index, "Product" + to_string(index));
+
+    return table;
+}
+
+/// @brief Writes a snapshot of the products, their bill totals and the bank account to INVENTORY_SNAPSHOT_PATH without stopping the sales.
+/// Prices and names never change and are copied first; quantities, bill totals and money are read at one cut between sales,
+/// taken with ShopBankAccount::getTotalConsistent().
+template <typename Policy>
+void writeInventorySnapshot(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
+{
+    vector<SnapshotProduct> products(product_database.size());
+    string names;
+
+    for (BasicProduct<Policy> &product : product_database)
+    {
+        SnapshotProduct &record = products[product.getId() - 1];
+        string name = product.getName();
+
+        record.id = product.getId();
+        record.price = product.getPrice();
+        record.initial_quantity = product.getInitialQuantity();
+        record.name_offset = names.size();
+        record.name_length = name.size();
+        names += name;
+    }
+
+    long long int money = shop_account->getTotalConsistent([&]
+    {
+        for (SnapshotProduct &record : products)
+        {
+            // reservations do not outlive the process, a restored product has its reserved units back in stock
+            record.quantity = record.initial_quantity - product_database[record.id].getSoldQuantity();
+            record.sold_quantity = bills->getTotalQuantityFor(record.id);
+            record.sold_amount = bills->getTotalAmountFor(record.id);
+        }
+    });
+
+    InventorySnapshot::write(INVENTORY_SNAPSHOT_PATH, products, names, money);
+}
+
+/// @brief Method for the thread writing an inventory snapshot INVENTORY_SNAPSHOT_DELAY_MS after the sales started
+template <typename Policy>
+void inventorySnapshotThread(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account)
+{
+    this_thread::sleep_for(chrono::milliseconds(INVENTORY_SNAPSHOT_DELAY_MS));
+
+    auto start = std::chrono::steady_clock::now();
+    writeInventorySnapshot(product_database, bills, shop_account);
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    acout << "[MAIN] Inventory snapshot written to " << INVENTORY_SNAPSHOT_PATH << " in " << elapsed << "us\n";
+}
+
+/// @brief Rebuilds products, bill totals and the bank account from INVENTORY_SNAPSHOT_PATH, checks them and reports
+/// the load time next to the time getProducts() takes to build a fresh product set.
+template <typename Policy>
+void restoreFromSnapshot()
+{
+    acout << "[MAIN] Restoring from " << INVENTORY_SNAPSHOT_PATH << "\n";
+    auto start = std::chrono::steady_clock::now();
+
+    shared_ptr<InventorySnapshot> snapshot = make_shared<InventorySnapshot>(INVENTORY_SNAPSHOT_PATH);
+    BasicProductTable<Policy> product_database(snapshot->getProductCount());
+    shared_ptr<BasicBillList<Policy>> bills = makeBillList<Policy>(product_database.size());
+    shared_ptr<ShopBankAccount> shop_account(new ShopBankAccount());
+
+    // the names stay in the mapping, the table only keeps views of them
+    const SnapshotProduct *products = snapshot->products();
+    for (int index = 0; index < snapshot->getProductCount(); ++index)
+    {
+        const SnapshotProduct &record = products[index];
+        product_database.restoreProduct(record.id, record.price, record.initial_quantity, record.quantity, snapshot->name(record));
+    }
+    product_database.keepAlive(snapshot);
+
+    bills->restoreSales(snapshot->getProductCount(), [&](int index, int &id, long long int &quantity, long long int &amount)
+    {
+        id = products[index].id;
+        quantity = products[index].sold_quantity;
+        amount = products[index].sold_amount;
+    });
+
+    shop_account->restore(snapshot->getMoney());
+
+    auto restored = chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    getProducts<Policy>();
+    auto generated = chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    acout << "[MAIN] Restored " << product_database.size() << " products in " << restored << "us, getProducts() takes " << generated << "us\n";
+
+    inventoryCheck(product_database, bills, shop_account);
+
+    if (AUDIT_CHECK)
+        auditCheck(bills);
+}
+
+/// @brief Compares the leaderboard with the top sellers found by scanning the bill totals of every product, and prints it
+template <typename Policy>
+bool leaderboardCheck(Leaderboard &leaderboard, shared_ptr<BasicBillList<Policy>> bills, int product_count)
+{
+    vector<LeaderboardEntry> scanned;
+    for (int id = 1; id <= product_count; ++id)
+        if (bills->getTotalQuantityFor(id) > 0)
+            scanned.push_back({id, bills->getTotalQuantityFor(id), bills->getTotalAmountFor(id)});
+
+    auto check = [&](vector<LeaderboardEntry> board, bool by_revenue)
+    {
+        size_t count = min<size_t>(LEADERBOARD_TOP, scanned.size());
+        partial_sort(scanned.begin(), scanned.begin() + count, scanned.end(), [&](const LeaderboardEntry &first, const LeaderboardEntry &second)
+        {
+            long long int left = by_revenue ? first.revenue : first.quantity, right = by_revenue ? second.revenue : second.quantity;
+            return left != right ? left > right : first.id < second.id;
+        });
+
+        if (board.size() != count)
+            return false;
+
+        for (size_t index = 0; index < count; ++index)
+            if (board[index].id != scanned[index].id || board[index].quantity != scanned[index].quantity || board[index].revenue != scanned[index].revenue)
+                return false;
+
+        return true;
+    };
+
+    vector<LeaderboardEntry> by_quantity = leaderboard.topByQuantity(LEADERBOARD_TOP);
+    vector<LeaderboardEntry> by_revenue = leaderboard.topByRevenue(LEADERBOARD_TOP);
+
+    if (!check(by_quantity, false) || !check(by_revenue, true))
+    {
+        acout << "==============================================\n";
+        acout << "  Leaderboard check failed\n";
+        acout << "==============================================\n";
+        return false;
+    }
+
+    acout << "[MAIN] Best sellers by quantity:";
+    for (LeaderboardEntry &entry : by_quantity)
+        acout << " " << entry.id << " (" << entry.quantity << ")";
+    acout << "\n[MAIN] Best sellers by revenue:";
+    for (LeaderboardEntry &entry : by_revenue)
+        acout << " " << entry.id << " (" << entry.revenue << ")";
+    acout << "\n";
+
+    return true;
+}
+
+/// @brief Replays the on-disk journal in JOURNAL_DIRECTORY into `product_database`, `bills` and `shop_account`.
+/// Only the units purchase() hands out are billed, a record the rebuilt stock cannot cover is counted in `short_records`.
+/// @return Number of records replayed
+template <typename Policy>
+long long int replayJournal(BasicProductTable<Policy> &product_database, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account,
+                            long long int &short_records)
+{
+    unordered_map<uint64_t, shared_ptr<BasicBill<Policy>>> recovered_bills;
+    short_records = 0;
+
+    return DurableJournal::replay(JOURNAL_DIRECTORY, [&](const DurableRecord &record)
+    {
+        BasicProduct<Policy> &product = product_database.at(record.product_id);
+        shared_ptr<BasicBill<Policy>> &bill = recovered_bills[record.bill_key];
+
+        if (bill == nullptr)
+        {
+            bill = make_shared<BasicBill<Policy>>();
+            bills->registerBill(bill);
+        }
+
+        int amount = product.purchase(record.quantity);
+        if (amount != record.quantity)
+            ++short_records;
+
+        shop_account->registerTransaction((long long int)amount * record.price);
+        bill->addProduct(record.product_id, amount, record.price);
+    });
+}
+
+/// @brief Reports the records of a replay that asked for more units than the rebuilt stock held
+/// @return true if there were none
+bool shortRecordCheck(long long int short_records)
+{
+    if (short_records != 0)
+    {
+        acout << "==============================================\n";
+        acout << "  Journal recovery failed\n";
+        acout << "  Records short of stock: " << short_records << "\n";
+        acout << "==============================================\n";
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief Replays JOURNAL_DIRECTORY on a fresh set of products and compares the rebuilt quantities and money with the final state
+/// of the durable run that wrote it. The bills only feed the replay, they are not archived.
+/// @return true if every product and the bank account match
+template <typename Policy>
+bool journalReplayCheck(BasicProductTable<Policy> &product_database, shared_ptr<ShopBankAccount> shop_account)
+{
+    BasicProductTable<Policy> rebuilt = getProducts<Policy>();
+    shared_ptr<BasicBillList<Policy>> bills = make_shared<BasicBillList<Policy>>(rebuilt.size());
+    shared_ptr<ShopBankAccount> rebuilt_account(new ShopBankAccount());
+    long long int short_records;
+
+    long long int records = replayJournal(rebuilt, bills, rebuilt_account, short_records);
+    acout << "[MAIN] Replayed " << records << " journal records into " << bills->getLiveBillCount() << " bills\n";
+
+    if (!shortRecordCheck(short_records))
+        return false;
+
+    for (BasicProduct<Policy> &product : product_database)
+    {
+        BasicProduct<Policy> &replayed = rebuilt.at(product.getId());
+
+        if (replayed.getQuantity() != product.getQuantity())
+        {
+            acout << "==============================================\n";
+            acout << "  Journal replay check failed\n";
+            acout << "  Product ID: " << product.getId() << "\n";
+            acout << "  Database quantity: " << product.getQuantity() << "\n";
+            acout << "  Replayed quantity: " << replayed.getQuantity() << "\n";
+            acout << "==============================================\n";
+            return false;
+        }
+    }
+
+    if (rebuilt_account->getTotal() != shop_account->getTotal() || bills->getTotalAmount() != shop_account->getTotal())
+    {
+        acout << "==============================================\n";
+        acout << "  Journal replay check failed\n";
+        acout << "  Bank account amount: " << shop_account->getTotal() << "\n";
+        acout << "  Replayed amount: " << rebuilt_account->getTotal() << "\n";
+        acout << "  Replayed bill amount: " << bills->getTotalAmount() << "\n";
+        acout << "==============================================\n";
+        return false;
+    }
+
+    acout << "    - - - - Consistency check is successful - - - -\n";
+    return true;
+}
+
+/// @brief Runs `thread_count` sale threads with the given sale mode on a fresh set of products, checking the inventory while they run.
+/// @param name Name of the run in the report
+/// @param trace Operation trace with one stream per thread, or nullptr
+/// @param replay Replay `trace` instead of drawing from the workload; otherwise the operations of the run are recorded into it
+/// @param with_leaderboard Report every sale to a leaderboard and check it once the sales are done
+/// @return Throughput and latency of the sales
+template <typename Policy>
+SaleResult runSaleBenchmark(SaleMode mode, string name, int thread_count = THREAD_COUNT, OperationTrace *trace = nullptr, bool replay = false,
+                            bool with_leaderboard = false)
+{
+    acout << "[MAIN] Sale mode: " << name << "\n";
+
+    if (trace != nullptr && trace->getThreadCount() != thread_count)
+        throw invalid_argument("runSaleBenchmark: the trace has " + to_string(trace->getThreadCount()) + " threads, not " + to_string(thread_count));
+
+    atomic_bool still_executing = true;
+    vector<thread> children;
+    vector<SaleStats> stats(thread_count);
+
+    BasicProductTable<Policy> product_database = getProducts<Policy>();
+    Workload workload(product_database.size(), workloadConfig());
+
+    if (trace != nullptr && trace->getProductCount() != product_database.size())
+        throw invalid_argument("runSaleBenchmark: the trace was recorded on " + to_string(trace->getProductCount()) + " products");
+
+    shared_ptr<BasicBillList<Policy>> bills = makeBillList<Policy>(product_database.size());
+    shared_ptr<ShopBankAccount> shop_account(new ShopBankAccount());
+    shared_ptr<DurableJournal> durable_journal;
+    shared_ptr<Leaderboard> leaderboard;
+
+    if (with_leaderboard)
+        leaderboard = make_shared<Leaderboard>(product_database.size(), LEADERBOARD_CAPACITY, LEADERBOARD_RING_CAPACITY,
+                                               chrono::milliseconds(LEADERBOARD_MERGE_INTERVAL_MS));
+
+    if (mode == DURABLE_MODE)
+    {
+        mkdir(JOURNAL_DIRECTORY, 0755);
+        DurableJournal::clear(JOURNAL_DIRECTORY);
+        durable_journal = make_shared<DurableJournal>(JOURNAL_DIRECTORY, JOURNAL_SEGMENT_RECORDS, JOURNAL_FSYNC_POLICY,
+                                                      chrono::milliseconds(JOURNAL_FSYNC_INTERVAL_MS));
+    }
+
+    acout << "[MAIN] Starting more threads\n";
+    auto start = std::chrono::system_clock::now();
+    auto start_time = std::chrono::system_clock::to_time_t(start);
+    acout << "[MAIN] Start time: " << ctime(&start_time) << "\n";
+
+    for (int index = 0; index < thread_count; ++index)
+        children.push_back(thread(threadWork<Policy>, ref(product_database), bills, shop_account, cref(workload), WORKLOAD_SEED + index, mode,
+                                  durable_journal, leaderboard, trace != nullptr ? &trace->stream(index) : nullptr, replay, ref(stats[index])));
+
+    thread stateValidator(inventoryCheckThread<Policy>, ref(product_database), bills, shop_account, ref(still_executing), mode);
+    thread compactor;
+    if (BILL_COMPACTION)
+        compactor = thread(billCompactionThread<Policy>, bills, ref(still_executing));
+
+    thread snapshotter;
+    if (WRITE_INVENTORY_SNAPSHOT && mode == MUTEX_MODE)
+        snapshotter = thread(inventorySnapshotThread<Policy>, ref(product_database), bills, shop_account);
+
+    for (thread &child : children)
+    {
+        child.join();
+    }
+
+    auto end = std::chrono::system_clock::now();
+    auto end_time = std::chrono::system_clock::to_time_t(end);
+    auto sales_elapsed = chrono::duration_cast<chrono::milliseconds>(end - start).count();
+    acout << "[MAIN] Sales finish time: " << ctime(&end_time) << "\n";
+    acout << "[MAIN] Sales elapsed time: " << sales_elapsed << "ms\n";
+
+    if (durable_journal != nullptr)
+    {
+        acout << "[MAIN] Journaled records: " << durable_journal->getRecordCount() << ", syncs: " << durable_journal->getSyncCount() << "\n";
+        durable_journal.reset();
+    }
+
+    still_executing = false;
+    stateValidator.join();
+
+    if (snapshotter.joinable())
+        snapshotter.join();
+
+    if (BILL_COMPACTION)
+    {
+        compactor.join();
+        bills->compact();
+        archiveCheck(bills);
+        acout << "[MAIN] Bills: " << bills->getLiveBillCount() << " live, " << bills->getCompactedBillCount() << " compacted into "
+              << bills->getSegmentCount() << " segments\n";
+    }
+
+    if (mode == LOCK_FREE_MODE)
+        inventoryCheckLockFree(product_database, bills, shop_account, true);
+    else inventoryCheck(product_database, bills, shop_account);
+
+    if (AUDIT_CHECK)
+        auditCheck(bills);
+
+    if (leaderboard != nullptr)
+    {
+        leaderboard->merge();
+        leaderboardCheck(*leaderboard, bills, product_database.size());
+    }
+
+    // the journal was closed after the sales, it must rebuild exactly the state the run ended with
+    if (mode == DURABLE_MODE)
+        journalReplayCheck(product_database, shop_account);
+
+    end = std::chrono::system_clock::now();
+    end_time = std::chrono::system_clock::to_time_t(end);
+    auto elapsed_seconds = chrono::duration_cast<chrono::milliseconds>(end - start).count();
+    acout << "[MAIN] Finish time: " << ctime(&end_time) << "\n";
+    acout << "[MAIN] Total elapsed time: " << elapsed_seconds << "ms\n";
+
+    return summarizeSales(name, stats, sales_elapsed);
+}
+
+/// @brief Rebuilds product quantities, bills and the bank account from the on-disk journal in JOURNAL_DIRECTORY,
+/// checks the result and reports the replay speed.
+template <typename Policy>
+void recoverFromJournal()
+{
+    BasicProductTable<Policy> product_database = getProducts<Policy>();
+
+    shared_ptr<BasicBillList<Policy>> bills = makeBillList<Policy>(product_database.size());
+    shared_ptr<ShopBankAccount> shop_account(new ShopBankAccount());
+    long long int short_records;
+
+    acout << "[MAIN] Recovering from " << JOURNAL_DIRECTORY << "\n";
+    auto start = std::chrono::steady_clock::now();
+
+    long long int records = replayJournal(product_database, bills, shop_account, short_records);
+
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    acout << "[MAIN] Replayed " << records << " records into " << bills->getLiveBillCount() << " bills in " << elapsed / 1000 << "ms ("
+          << (elapsed > 0 ? records * 1000000 / elapsed : records) << " records/s)\n";
+
+    shortRecordCheck(short_records);
+    inventoryCheck(product_database, bills, shop_account);
+
+    if (AUDIT_CHECK)
+        auditCheck(bills);
+}
+
+/// @brief Runs `thread_count` basket sale threads on a fresh set of products, checking the inventory while they run.
+/// @param config Key distribution of the baskets
+/// @param retries Receives the number of times a basket had to start over
+/// @return Time spent on sales, in microseconds
+template <typename Policy>
+long long int runBasketBenchmark(int basket_size, int thread_count, BasketLocking locking, const WorkloadConfig &config, long long int &retries)
+{
+    atomic_bool still_executing = true;
+    vector<thread> children;
+    vector<long long int> thread_retries(thread_count, 0);
+
+    BasicProductTable<Policy> product_database = getProducts<Policy>();
+    Workload workload(product_database.size(), config);
+
+    shared_ptr<BasicBillList<Policy>> bills = makeBillList<Policy>(product_database.size());
+    shared_ptr<ShopBankAccount> shop_account(new ShopBankAccount());
+
+    auto start = std::chrono::system_clock::now();
+
+    for (int index = 0; index < thread_count; ++index)
+        children.push_back(thread(basketWork<Policy>, ref(product_database), bills, shop_account, cref(workload), WORKLOAD_SEED + index, basket_size,
+                                  locking, ref(thread_retries[index])));
+
+    thread stateValidator(inventoryCheckThread<Policy>, ref(product_database), bills, shop_account, ref(still_executing), MUTEX_MODE);
+    thread compactor;
+    if (BILL_COMPACTION)
+        compactor = thread(billCompactionThread<Policy>, bills, ref(still_executing));
+
+    for (thread &child : children)
+    {
+        child.join();
+    }
+
+    auto end = std::chrono::system_clock::now();
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start).count();
+
+    still_executing = false;
+    stateValidator.join();
+
+    if (BILL_COMPACTION)
+    {
+        compactor.join();
+        bills->compact();
+        archiveCheck(bills);
+    }
+
+    inventoryCheck(product_database, bills, shop_account);
+
+    if (AUDIT_CHECK)
+        auditCheck(bills);
+
+    retries = 0;
+    for (long long int count : thread_retries)
+        retries += count;
+
+    return elapsed;
+}
+
+/// @brief Runs the basket workload for every combination of BASKET_SIZES and BASKET_THREAD_COUNTS and prints the throughput,
+/// with the share of basket attempts that had to start over
+template <typename Policy>
+void runBasketSweep(BasketLocking locking, WorkloadConfig config = workloadConfig())
+{
+    vector<int> basket_sizes = BASKET_SIZES;
+    vector<int> thread_counts = BASKET_THREAD_COUNTS;
+    vector<string> rows;
+
+    for (int thread_count : thread_counts)
+    {
+        for (int basket_size : basket_sizes)
+        {
+            long long int retries;
+            long long int elapsed = max(runBasketBenchmark<Policy>(basket_size, thread_count, locking, config, retries), 1LL);
+            long long int baskets = (long long int)thread_count * BASKET_OPERATIONS;
+
+            ostringstream retry_rate;
+            retry_rate << fixed << setprecision(2) << retries * 100.0 / (baskets + retries) << "%";
+
+            rows.push_back("  " + to_string(thread_count) + "\t| " + to_string(basket_size) + "\t| " + to_string(elapsed / 1000) + "ms\t| " +
+                           to_string(baskets * 1000000 / elapsed) + "\t| " + to_string(baskets * basket_size * 1000000 / elapsed) + "\t| " +
+                           to_string(retries) + " (" + retry_rate.str() + ")\n");
+        }
+    }
+
+    acout << "==============================================\n";
+    acout << "  Basket sales, " << basketLockingName(locking) << " locking, " << keyDistributionName(config) << " keys, " << BASKET_OPERATIONS
+          << " baskets per thread\n";
+    acout << "  threads | basket size | time | baskets/s | items/s | retries\n";
+    for (const string &row : rows)
+        acout << row;
+    acout << "==============================================\n";
+}
+
+/// @brief Method for threads that sell through a PartitionedShop. Sales are handed to the owner of the product without waiting for it,
+/// so the sampled latency is the time to queue the request. The workload's operation mix is ignored, every operation is a sale.
+/// @param client Index of the thread among the clients of the shop
+/// @param trace Stream of the thread in an operation trace to replay instead of drawing from `workload`, or nullptr. Its browses are skipped.
+void partitionedSaleWork(PartitionedShop &shop, const Workload &workload, uint64_t seed, int client, const vector<TraceOperation> *trace, SaleStats &stats)
+{
+    WorkloadGenerator generator(workload, seed);
+    int count;
+    size_t position = 0;
+
+    if (trace != nullptr)
+        count = trace->size();
+    else count = THREAD_RANDOMIZE_COUNT ? THREAD_OPERATIONS * generator.nextInt(1, 5) : THREAD_OPERATIONS;
+
+    stats.operations = count;
+
+    while (count > 0)
+    {
+        count--;
+
+        bool sampled = count % LATENCY_SAMPLE_RATE == 0;
+        chrono::steady_clock::time_point sale_start;
+        if (sampled)
+            sale_start = chrono::steady_clock::now();
+
+        if (trace == nullptr)
+            shop.sell(client, generator.nextKey(), generator.nextInt(1, 100));
+        else if (!(*trace)[position].isBrowse())
+            shop.sell(client, (*trace)[position].getProductId(), (*trace)[position].getQuantity());
+
+        ++position;
+
+        if (sampled)
+            stats.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sale_start).count());
+    }
+}
+
+/// @brief Method for threads that sell baskets through a PartitionedShop, waiting for the votes of every basket
+/// @param aborted Receives the number of baskets that could not be sold whole
+void partitionedBasketWork(PartitionedShop &shop, const Workload &workload, uint64_t seed, int client, int basket_size, long long int &aborted)
+{
+    WorkloadGenerator generator(workload, seed);
+    vector<int> quantities(basket_size), reserved;
+
+    for (int count = 0; count < BASKET_OPERATIONS; ++count)
+    {
+        vector<int> basket = randomBasket(generator, basket_size);
+
+        for (int &quantity : quantities)
+            quantity = generator.nextInt(1, 100);
+
+        if (!shop.sellBasket(client, basket, quantities, reserved))
+            ++aborted;
+    }
+}
+
+/// @brief Checks a stopped PartitionedShop, reporting the first inconsistent product
+bool partitionedAuditCheck(PartitionedShop &shop)
+{
+    int id;
+
+    if (!shop.audit(id))
+    {
+        acout << "==============================================\n";
+        acout << "  Partitioned shop audit failed\n";
+        if (id != 0)
+            acout << "  Product ID: " << id << "\n";
+        else acout << "  Revenue differs from the sold amounts\n";
+        acout << "==============================================\n";
+        return false;
+    }
+
+    acout << "    - - - - Consistency check is successful - - - -\n";
+    return true;
+}
+
+/// @brief Method for checkout threads: reserves a product drawn from `workload`, pays for RESERVATION_PAYMENT_NS without holding
+/// any lock, then commits the reservation to the thread's bill, cancels it or leaves it to expire
+/// @param late Receives the number of commits that came after the reservation expired
+template <typename Policy>
+void checkoutWork(StockReservations<Policy> &reservations, shared_ptr<BasicBillList<Policy>> bills, shared_ptr<ShopBankAccount> shop_account,
+                  const Workload &workload, uint64_t seed, long long int &late)
+{
+    WorkloadGenerator generator(workload, seed);
+    shared_ptr<BasicBill<Policy>> bill(new BasicBill<Policy>());
+    bills->registerBill(bill);
+
+    for (int count = 0; count < RESERVATION_OPERATIONS; ++count)
+    {
+        ReservationToken token = reservations.reserve(generator.nextKey(), generator.nextInt(1, 10), chrono::milliseconds(RESERVATION_TTL_MS));
+        if (!token.valid())
+            continue;
+
+        auto paid = chrono::steady_clock::now() + chrono::nanoseconds(RESERVATION_PAYMENT_NS);
+        while (chrono::steady_clock::now() < paid)
+            cpuRelax();
+
+        int outcome = generator.nextInt(1, 100);
+
+        if (outcome <= RESERVATION_ABANDON_PERCENT)
+            continue;
+        else if (outcome <= RESERVATION_ABANDON_PERCENT + RESERVATION_CANCEL_PERCENT)
+            reservations.cancel(token);
+        else if (!reservations.commit(token, *bill, *shop_account))
+            ++late;
+    }
+
+    bill->close();
+}
+
+/// @brief Checks the reserved units of every product against the reservations still held
+template <typename Policy>
+bool reservationCheck(StockReservations<Policy> &reservations)
+{
+    int id;
+
+    if (!reservations.audit(id))
+    {
+        acout << "==============================================\n";
+        acout << "  Reservation check failed\n";
+        acout << "  Product ID: " << id << "\n";
+        acout << "==============================================\n";
+        return false;
+    }
+
+    acout << "    - - - - Consistency check is successful - - - -\n";
+    return true;
+}
+
+/// @brief Runs RESERVATION_CHECKOUT_THREADS checkout threads next to RESERVATION_SALE_THREADS mutex-mode sale threads on the same
+/// products, checking the inventory while they run. Once they are done, waits for the abandoned reservations to expire and checks
+/// that no unit is left reserved.
+SaleResult runReservationBenchmark()
+{
+    string name = "reservations(" + to_string(RESERVATION_CHECKOUT_THREADS) + " checkouts)";
+    acout << "[MAIN] Sale mode: " << name << "\n";
 
-    map<int, shared_ptr<Product>> product_database = getProducts();
+    atomic_bool still_executing = true;
+    vector<thread> children;
+    vector<SaleStats> stats(RESERVATION_SALE_THREADS);
+    vector<long long int> late(RESERVATION_CHECKOUT_THREADS);
 
-    shared_ptr<BillList> bills(new BillList());
+    BasicProductTable<ShopPolicy> product_database = getProducts<ShopPolicy>();
+    Workload workload(product_database.size(), workloadConfig());
+    shared_ptr<BasicBillList<ShopPolicy>> bills = makeBillList<ShopPolicy>(product_database.size());
     shared_ptr<ShopBankAccount> shop_account(new ShopBankAccount());
+    StockReservations<ShopPolicy> reservations(product_database, RESERVATION_CAPACITY, RESERVATION_WHEEL_SIZE, chrono::milliseconds(RESERVATION_TICK_MS));
 
-    acout << "[MAIN] Starting more threads\n";
-    auto start = std::chrono::system_clock::now();
-    auto start_time = std::chrono::system_clock::to_time_t(start);
-    acout << "[MAIN] Start time: " << ctime(&start_time) << "\n";
+    auto start = std::chrono::steady_clock::now();
 
-    for (int index = 0; index < THREAD_COUNT; ++index)
-        children.push_back(thread(threadWork, ref(product_database), bills, shop_account, rand() % 20000));
+    for (int index = 0; index < RESERVATION_SALE_THREADS; ++index)
+        children.push_back(thread(threadWork<ShopPolicy>, ref(product_database), bills, shop_account, cref(workload), WORKLOAD_SEED + index,
+                                  MUTEX_MODE, nullptr, nullptr, nullptr, false, ref(stats[index])));
 
-    thread stateValidator(inventoryCheckThread, ref(product_database), bills, ref(still_executing));
+    for (int index = 0; index < RESERVATION_CHECKOUT_THREADS; ++index)
+        children.push_back(thread(checkoutWork<ShopPolicy>, ref(reservations), bills, shop_account, cref(workload),
+                                  WORKLOAD_SEED + RESERVATION_SALE_THREADS + index, ref(late[index])));
+
+    thread stateValidator(inventoryCheckThread<ShopPolicy>, ref(product_database), bills, shop_account, ref(still_executing), MUTEX_MODE);
 
     for (thread &child : children)
     {
         child.join();
     }
 
-    auto end = std::chrono::system_clock::now();
-    auto end_time = std::chrono::system_clock::to_time_t(end);
-    auto elapsed_seconds = chrono::duration_cast<chrono::milliseconds>(end - start).count();
-    acout << "[MAIN] Sales finish time: " << ctime(&end_time) << "\n";
-    acout << "[MAIN] Sales elapsed time: " << elapsed_seconds << "ms\n";
+    auto sales_elapsed = chrono::duration_cast<chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    acout << "[MAIN] Sales elapsed time: " << sales_elapsed << "ms\n";
+
+    while (reservations.getOutstandingCount() > 0)
+        this_thread::sleep_for(chrono::milliseconds(RESERVATION_TICK_MS));
 
     still_executing = false;
     stateValidator.join();
-    inventoryCheck(ref(product_database), bills);
 
-    end = std::chrono::system_clock::now();
-    end_time = std::chrono::system_clock::to_time_t(end);
-    elapsed_seconds = chrono::duration_cast<chrono::milliseconds>(end - start).count();
-    acout << "[MAIN] Finish time: " << ctime(&end_time) << "\n";
-    acout << "[MAIN] Total elapsed time: " << elapsed_seconds << "ms\n";
+    inventoryCheck(product_database, bills, shop_account);
+    reservationCheck(reservations);
+
+    if (AUDIT_CHECK)
+        auditCheck(bills);
+
+    long long int late_commits = 0;
+    for (long long int count : late)
+        late_commits += count;
+
+    acout << "==============================================\n";
+    acout << "  Reservations: " << reservations.getReservedCount() << " made, " << reservations.getRejectedCount() << " rejected, "
+          << reservations.getCommittedCount() << " committed, " << reservations.getCancelledCount() << " cancelled, "
+          << reservations.getExpiredCount() << " expired, " << late_commits << " committed too late\n";
+    acout << "==============================================\n";
+
+    return summarizeSales(name, stats, sales_elapsed);
+}
+
+/// @brief Runs `thread_count` sale threads on a PartitionedShop of PARTITION_COUNT owners. The elapsed time lasts until the owners
+/// have served every request, the shop is audited once they are stopped.
+/// @param trace Operation trace replayed by the threads instead of drawing from the workload, with one stream per thread, or nullptr
+SaleResult runPartitionedBenchmark(int thread_count = THREAD_COUNT, OperationTrace *trace = nullptr)
+{
+    string name = "partitioned(" + to_string(PARTITION_COUNT) + ")";
+    acout << "[MAIN] Sale mode: " << name << "\n";
+
+    vector<thread> children;
+    vector<SaleStats> stats(thread_count);
+
+    BasicProductTable<MutexPolicy> product_database = getProducts<MutexPolicy>();
+    Workload workload(product_database.size(), workloadConfig());
+    PartitionedShop shop(product_database, PARTITION_COUNT, thread_count, PARTITION_QUEUE_CAPACITY, PARTITION_PIN_THREADS);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int index = 0; index < thread_count; ++index)
+        children.push_back(thread(partitionedSaleWork, ref(shop), cref(workload), WORKLOAD_SEED + index, index,
+                                  trace != nullptr ? &trace->stream(index) : nullptr, ref(stats[index])));
+
+    for (thread &child : children)
+    {
+        child.join();
+    }
+
+    shop.stop();
+    auto sales_elapsed = chrono::duration_cast<chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    acout << "[MAIN] Sales elapsed time: " << sales_elapsed << "ms\n";
+
+    partitionedAuditCheck(shop);
+
+    return summarizeSales(name, stats, sales_elapsed);
+}
+
+/// @brief Runs `thread_count` basket sale threads on a PartitionedShop
+/// @param aborted Receives the number of baskets that could not be sold whole
+/// @return Time spent on sales, in microseconds
+long long int runPartitionedBasketBenchmark(int basket_size, int thread_count, long long int &aborted)
+{
+    vector<thread> children;
+    vector<long long int> thread_aborted(thread_count, 0);
+
+    BasicProductTable<MutexPolicy> product_database = getProducts<MutexPolicy>();
+    Workload workload(product_database.size(), workloadConfig());
+    PartitionedShop shop(product_database, PARTITION_COUNT, thread_count, PARTITION_QUEUE_CAPACITY, PARTITION_PIN_THREADS);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int index = 0; index < thread_count; ++index)
+        children.push_back(thread(partitionedBasketWork, ref(shop), cref(workload), WORKLOAD_SEED + index, index, basket_size, ref(thread_aborted[index])));
+
+    for (thread &child : children)
+    {
+        child.join();
+    }
+
+    shop.stop();
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    partitionedAuditCheck(shop);
+
+    aborted = 0;
+    for (long long int count : thread_aborted)
+        aborted += count;
+
+    return elapsed;
+}
+
+/// @brief Runs the partitioned basket workload for every combination of BASKET_SIZES and BASKET_THREAD_COUNTS and prints the throughput
+void runPartitionedBasketSweep()
+{
+    vector<int> basket_sizes = BASKET_SIZES;
+    vector<int> thread_counts = BASKET_THREAD_COUNTS;
+    vector<string> rows;
+
+    for (int thread_count : thread_counts)
+    {
+        for (int basket_size : basket_sizes)
+        {
+            long long int aborted;
+            long long int elapsed = max(runPartitionedBasketBenchmark(basket_size, thread_count, aborted), 1LL);
+            long long int baskets = (long long int)thread_count * BASKET_OPERATIONS;
+
+            rows.push_back("  " + to_string(thread_count) + "\t| " + to_string(basket_size) + "\t| " + to_string(elapsed / 1000) + "ms\t| " +
+                           to_string(baskets * 1000000 / elapsed) + "\t| " + to_string(baskets * basket_size * 1000000 / elapsed) + "\t| " +
+                           to_string(aborted) + "\n");
+        }
+    }
+
+    acout << "==============================================\n";
+    acout << "  Basket sales, partitioned(" << PARTITION_COUNT << ") two-phase commit, " << BASKET_OPERATIONS << " baskets per thread\n";
+    acout << "  threads | basket size | time | baskets/s | items/s | aborted\n";
+    for (const string &row : rows)
+        acout << row;
+    acout << "==============================================\n";
+}
+
+/// @brief Times the sequential and the parallel inventory check on a product set with one bill per product
+void runAuditBenchmark()
+{
+    BasicProductTable<MutexPolicy> product_database = getProducts<MutexPolicy>();
+    shared_ptr<BillList> bills(new BillList(product_database.size()));
+    shared_ptr<ShopBankAccount> shop_account(new ShopBankAccount());
+
+    for (Product &product : product_database)
+    {
+        shared_ptr<Bill> bill(new Bill());
+        int amount = product.purchase(1);
+
+        bill->addProduct(product.getId(), amount, product.getPrice());
+        shop_account->registerTransaction(amount * product.getPrice());
+        bills->registerBill(bill);
+    }
+
+    auto time = [&](void (*check)(ProductTable &, shared_ptr<BillList>, shared_ptr<ShopBankAccount>))
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < AUDIT_BENCHMARK_ROUNDS; ++round)
+            check(product_database, bills, shop_account);
+        return chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / AUDIT_BENCHMARK_ROUNDS;
+    };
+
+    long long int sequential = time(inventoryCheckSequential<MutexPolicy>);
+    long long int parallel = time(inventoryCheckParallel<MutexPolicy>);
+
+    acout << "==============================================\n";
+    acout << "  Inventory check, " << product_database.size() << " products, " << AUDIT_BENCHMARK_ROUNDS << " rounds\n";
+    acout << "  sequential: " << sequential << "us, parallel (" << auditPool().size() + 1 << " threads): " << parallel << "us\n";
+    acout << "==============================================\n";
+}
+
+/// @brief Replays the trace at OPERATION_TRACE_PATH under every sale mode and lock policy, so the throughputs compare runs
+/// that did exactly the same operations
+void runTraceReplay()
+{
+    OperationTrace trace = OperationTrace::load(OPERATION_TRACE_PATH);
+    int thread_count = trace.getThreadCount();
+    vector<SaleResult> results;
+
+    for (SaleMode mode : {MUTEX_MODE, LOCK_FREE_MODE, JOURNAL_MODE, DURABLE_MODE, BATCH_MODE})
+        results.push_back(runSaleBenchmark<ShopPolicy>(mode, saleModeName(mode), thread_count, &trace, true));
+
+    results.push_back(runPartitionedBenchmark(thread_count, &trace));
+    results.push_back(runSaleBenchmark<SpinLockPolicy>(MUTEX_MODE, "TTAS spinlock", thread_count, &trace, true));
+    results.push_back(runSaleBenchmark<TicketLockPolicy>(MUTEX_MODE, "ticket lock", thread_count, &trace, true));
+    results.push_back(runSaleBenchmark<StripedLockPolicy<256>>(MUTEX_MODE, "striped(256)", thread_count, &trace, true));
+
+    acout << "==============================================\n";
+    acout << "  Replay of " << OPERATION_TRACE_PATH << ", " << thread_count << " threads, " << trace.getOperationCount() << " operations\n";
+    for (SaleResult &result : results)
+        acout << "  " << result.toString() << "\n";
+    acout << "==============================================\n";
+}
+
+/// @brief Runs the mutex-mode workload with the striped lock policy, once for every stripe count
+template <int... STRIPE_COUNTS>
+void runStripedLockSweep(vector<SaleResult> &results, int thread_count)
+{
+    (results.push_back(runSaleBenchmark<StripedLockPolicy<STRIPE_COUNTS>>(MUTEX_MODE, "striped(" + to_string(STRIPE_COUNTS) + ")", thread_count)), ...);
+}
+
+/// @brief One virtual client: `count` sales or browses drawn from `workload`, letting the other ready clients run after every
+/// VIRTUAL_CLIENT_YIELD_BATCH of them.
+/// A sale finding its product locked suspends the client on the lock, the worker goes on with another client meanwhile.
+/// @param stats Receives the number of operations and the sampled latencies, including the time spent waiting for the lock
+ClientTask virtualClient(ClientScheduler &scheduler, BasicProductTable<CoroutinePolicy> &product_database, shared_ptr<BasicBill<CoroutinePolicy>> bill,
+                         ShopBankAccount &shop_account, const Workload &workload, uint64_t seed, int count, SaleStats &stats)
+{
+    WorkloadGenerator generator(workload, seed);
+    stats.operations = count;
+    int batch = 0;
+
+    while (count > 0)
+    {
+        count--;
+        int key = generator.nextKey();
+        BasicProduct<CoroutinePolicy> &product = product_database[key];
+
+        bool sampled = count % LATENCY_SAMPLE_RATE == 0;
+        chrono::steady_clock::time_point sale_start;
+        if (sampled)
+            sale_start = chrono::steady_clock::now();
+
+        if (generator.nextOperation() == BROWSE_OPERATION)
+            browseProduct(product);
+        else
+        {
+            int quantity = generator.nextInt(1, 100);
+
+            co_await product.lockAsync(scheduler);
+
+            // nothing below suspends, so the sale stays on one worker and the bank account stripe of beginSale() is the one of endSale()
+            shop_account.beginSale<CoroutinePolicy>();
+            product.beginWrite();
+            int amount = product.purchase(quantity);
+            shop_account.registerTransaction(amount * product.getPrice());
+            bill->addProduct(key, amount, product.getPrice());
+            product.endWrite();
+            shop_account.endSale();
+            product.unlock();
+        }
+
+        if (sampled)
+            stats.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sale_start).count());
+
+        if (++batch == VIRTUAL_CLIENT_YIELD_BATCH)
+        {
+            batch = 0;
+            co_await scheduler.yield();
+        }
+    }
+
+    bill->close();
+}
+
+/// @brief Runs VIRTUAL_CLIENT_OPERATIONS operations spread over `client_count` virtual clients, each with its own bill,
+/// checking the inventory while they run
+/// @param wakeups Receives the number of times a client suspended on a lock was handed it
+/// @param yields Receives the number of times a client yielded after a batch of operations
+SaleResult runVirtualClientBenchmark(int client_count, long long int &wakeups, long long int &yields)
+{
+    string name = to_string(client_count) + " clients";
+    acout << "[MAIN] Virtual clients: " << client_count << "\n";
+
+    atomic_bool still_executing = true;
+    vector<SaleStats> stats(client_count);
+
+    BasicProductTable<CoroutinePolicy> product_database = getProducts<CoroutinePolicy>();
+    Workload workload(product_database.size(), workloadConfig());
+    shared_ptr<BasicBillList<CoroutinePolicy>> bills = makeBillList<CoroutinePolicy>(product_database.size());
+    shared_ptr<ShopBankAccount> shop_account(new ShopBankAccount());
+
+    thread stateValidator(inventoryCheckThread<CoroutinePolicy>, ref(product_database), bills, shop_account, ref(still_executing), MUTEX_MODE);
+    thread compactor;
+    if (BILL_COMPACTION)
+        compactor = thread(billCompactionThread<CoroutinePolicy>, bills, ref(still_executing));
+
+    long long int sales_elapsed;
+    int worker_count;
+    {
+        ClientScheduler scheduler(VIRTUAL_CLIENT_WORKERS > 0 ? VIRTUAL_CLIENT_WORKERS : thread::hardware_concurrency());
+        worker_count = scheduler.size();
+        auto start = std::chrono::steady_clock::now();
+
+        for (int index = 0; index < client_count; ++index)
+        {
+            shared_ptr<BasicBill<CoroutinePolicy>> bill(new BasicBill<CoroutinePolicy>());
+            bills->registerBill(bill);
+
+            int count = VIRTUAL_CLIENT_OPERATIONS / client_count + (index < VIRTUAL_CLIENT_OPERATIONS % client_count ? 1 : 0);
+            scheduler.spawn(virtualClient(scheduler, product_database, bill, *shop_account, workload, WORKLOAD_SEED + index, count, stats[index]));
+        }
+
+        scheduler.wait();
+        sales_elapsed = chrono::duration_cast<chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        wakeups = scheduler.getWakeupCount();
+        yields = scheduler.getYieldCount();
+    }
+
+    acout << "[MAIN] Sales elapsed time: " << sales_elapsed << "ms\n";
+    acout << "[MAIN] Lock wake-ups: " << wakeups << ", yields: " << yields << "\n";
+
+    still_executing = false;
+    stateValidator.join();
+
+    if (BILL_COMPACTION)
+    {
+        compactor.join();
+        bills->compact();
+        archiveCheck(bills);
+    }
+
+    inventoryCheck(product_database, bills, shop_account);
+
+    if (AUDIT_CHECK)
+        auditCheck(bills);
+
+    // reported against the worker threads, the clients are in the name
+    SaleResult result = summarizeSales(name, stats, sales_elapsed);
+    result.thread_count = worker_count;
+    return result;
+}
+
+/// @brief Runs the virtual client benchmark for every client count of VIRTUAL_CLIENT_COUNTS
+void runVirtualClientSweep()
+{
+    vector<int> client_counts = VIRTUAL_CLIENT_COUNTS;
+    vector<SaleResult> results;
+    vector<long long int> wakeups(client_counts.size()), yields(client_counts.size());
+
+    for (size_t index = 0; index < client_counts.size(); ++index)
+        results.push_back(runVirtualClientBenchmark(client_counts[index], wakeups[index], yields[index]));
+
+    // every pass through the scheduler's single ready queue is either a lock wake-up or a yield, the report says which dominate
+    acout << "==============================================\n";
+    acout << "  Virtual clients, " << VIRTUAL_CLIENT_OPERATIONS << " operations per run, yielding every " << VIRTUAL_CLIENT_YIELD_BATCH << " operations\n";
+    for (size_t index = 0; index < results.size(); ++index)
+        acout << "  " << results[index].toString() << "\n    ready queue: " << wakeups[index] << " lock wake-ups, " << yields[index] << " yields\n";
+    acout << "==============================================\n";
+}
+
+/// @brief Runs the same mutex-mode workload under every lock policy and thread count of LOCK_POLICY_THREAD_COUNTS
+void runLockPolicySweep()
+{
+    vector<int> thread_counts = LOCK_POLICY_THREAD_COUNTS;
+    vector<SaleResult> results;
+
+    for (int thread_count : thread_counts)
+    {
+        results.push_back(runSaleBenchmark<MutexPolicy>(MUTEX_MODE, "std::mutex", thread_count));
+        results.push_back(runSaleBenchmark<SpinLockPolicy>(MUTEX_MODE, "TTAS spinlock", thread_count));
+        results.push_back(runSaleBenchmark<TicketLockPolicy>(MUTEX_MODE, "ticket lock", thread_count));
+        runStripedLockSweep<LOCK_STRIPE_COUNTS>(results, thread_count);
+    }
+
+    acout << "==============================================\n";
+    acout << "  Lock policies, " << THREAD_OPERATIONS << " operations per thread\n";
+    for (SaleResult &result : results)
+        acout << "  " << result.toString() << "\n";
+    acout << "==============================================\n";
+}
+
+int main()
+{
+    acout << "Main thread " << this_thread::get_id() << "\n";
+
+    vector<SaleResult> results;
+
+    if (RECOVER_FROM_JOURNAL)
+        recoverFromJournal<ShopPolicy>();
+
+    if (RUN_MUTEX_MODE && RECORD_OPERATION_TRACE)
+    {
+        OperationTrace trace(PRODUCT_COUNT, THREAD_COUNT);
+        results.push_back(runSaleBenchmark<ShopPolicy>(MUTEX_MODE, saleModeName(MUTEX_MODE), THREAD_COUNT, &trace));
+
+        trace.save(OPERATION_TRACE_PATH);
+        acout << "[MAIN] Recorded " << trace.getOperationCount() << " operations to " << OPERATION_TRACE_PATH << "\n";
+    }
+    else if (RUN_MUTEX_MODE)
+        results.push_back(runSaleBenchmark<ShopPolicy>(MUTEX_MODE, saleModeName(MUTEX_MODE)));
+
+    if (RUN_MUTEX_MODE && RUN_LEADERBOARD)
+        results.push_back(runSaleBenchmark<ShopPolicy>(MUTEX_MODE, saleModeName(MUTEX_MODE) + " + leaderboard", THREAD_COUNT, nullptr, false, true));
+
+    if (RUN_LOCK_FREE_MODE)
+        results.push_back(runSaleBenchmark<ShopPolicy>(LOCK_FREE_MODE, saleModeName(LOCK_FREE_MODE)));
+
+    if (RUN_JOURNAL_MODE)
+        results.push_back(runSaleBenchmark<ShopPolicy>(JOURNAL_MODE, saleModeName(JOURNAL_MODE)));
+
+    if (RUN_DURABLE_MODE)
+        results.push_back(runSaleBenchmark<ShopPolicy>(DURABLE_MODE, saleModeName(DURABLE_MODE)));
+
+    if (RUN_BATCH_MODE)
+        results.push_back(runSaleBenchmark<ShopPolicy>(BATCH_MODE, saleModeName(BATCH_MODE)));
+
+    if (RUN_PARTITIONED_MODE)
+        results.push_back(runPartitionedBenchmark());
+
+    if (RUN_RESERVATION_MODE)
+        results.push_back(runReservationBenchmark());
+
+    acout << "==============================================\n";
+    acout << "  " << THREAD_COUNT << " threads, " << THREAD_OPERATIONS << " operations per thread\n";
+    for (SaleResult &result : results)
+        acout << "  " << result.toString() << "\n";
+    acout << "==============================================\n";
+
+    if (RESTORE_FROM_INVENTORY_SNAPSHOT)
+    {
+        try
+        {
+            restoreFromSnapshot<ShopPolicy>();
+        }
+        catch (const runtime_error &error)
+        {
+            acout << "[MAIN] No snapshot restored: " << error.what() << "\n";
+        }
+    }
+
+    if (RUN_AUDIT_BENCHMARK)
+        runAuditBenchmark();
+
+    if (RUN_TRACE_REPLAY)
+    {
+        try
+        {
+            runTraceReplay();
+        }
+        catch (const runtime_error &error)
+        {
+            acout << "[MAIN] No trace replayed: " << error.what() << "\n";
+        }
+    }
+
+    if (RUN_LOCK_POLICY_SWEEP)
+        runLockPolicySweep();
+
+    if (RUN_VIRTUAL_CLIENT_SWEEP)
+        runVirtualClientSweep();
+
+    if (RUN_BASKET_SWEEP)
+    {
+        runBasketSweep<ShopPolicy>(ORDERED_LOCKING);
+        runBasketSweep<ShopPolicy>(TRY_LOCK_BACKOFF);
+        runBasketSweep<ShopPolicy>(OPTIMISTIC_LOCKING);
+    }
+
+    if (RUN_BASKET_SKEW_SWEEP)
+    {
+        WorkloadConfig uniform = workloadConfig(), skewed = workloadConfig();
+        uniform.distribution = UNIFORM_KEYS;
+        skewed.distribution = ZIPF_KEYS;
+
+        for (BasketLocking locking : {ORDERED_LOCKING, OPTIMISTIC_LOCKING})
+        {
+            runBasketSweep<ShopPolicy>(locking, uniform);
+            runBasketSweep<ShopPolicy>(locking, skewed);
+        }
+    }
+
+    if (RUN_PARTITIONED_BASKET_SWEEP)
+        runPartitionedBasketSweep();
+
+    if (LOCK_PROFILING)
+    {
+        ostringstream report;
+        LockProfiler::instance().printSummary(report, LOCK_PROFILE_TOP_PRODUCTS);
+        acout << report.str();
+
+        if (string(LOCK_PROFILE_CSV) != "")
+            LockProfiler::instance().writeCsv(LOCK_PROFILE_CSV);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
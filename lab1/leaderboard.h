@@ -0,0 +1,238 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include "locks.h"
+#include "spsc_queue.h"
+
+// Best-seller leaderboard. Every sale thread pushes its sales into its own SPSC ring, without locking or allocating; a merger
+// thread drains the rings into per-product totals every merge interval, and publishes the first entries by quantity and by
+// revenue as an immutable board. A merge costs one add per sale plus one partial sort of the products, so the merger keeps up
+// with the sale threads even on one core. Queries copy from the last published board, so they never wait for a sale and a sale never waits
+// for them. A board is at most one merge interval, plus the time of one merge, behind the sales. A sale thread only waits if
+// the merger falls a whole ring behind it.
+
+/// @brief One product of the leaderboard
+struct LeaderboardEntry
+{
+    int id;
+    long long int quantity;
+    long long int revenue;
+};
+
+/// @brief Sales of one thread not merged into the leaderboard yet
+class LeaderboardDeltas
+{
+private:
+    struct Delta
+    {
+        int id;
+        int quantity;
+        long long int amount;
+    };
+
+    // written by the sale thread only, read by the merger only
+    SpscQueue<Delta> ring;
+    int product_count;
+
+    friend class Leaderboard;
+
+public:
+    /// @param capacity Sales the ring holds between two merges, a power of two
+    /// @param product_count Highest product id accepted by record()
+    LeaderboardDeltas(size_t capacity, int product_count) : ring{capacity}, product_count{product_count} {}
+
+    /// @brief Queues a sale for the next merge. Only called by the thread owning the deltas.
+    /// A bad id is rejected here, in the sale thread, so the merger only ever sees valid ones.
+    void record(int id, int quantity, long long int amount)
+    {
+        if (id <= 0 || id > this->product_count)
+            throw std::out_of_range("Leaderboard: no product with id " + std::to_string(id));
+
+        int spins = 0;
+
+        while (!this->ring.tryPush({id, quantity, amount}))
+            spinWait(spins);
+    }
+};
+
+class Leaderboard
+{
+private:
+    struct Board
+    {
+        std::vector<LeaderboardEntry> by_quantity;
+        std::vector<LeaderboardEntry> by_revenue;
+    };
+
+    struct Totals
+    {
+        long long int quantity = 0;
+        long long int revenue = 0;
+    };
+
+    size_t capacity;
+    size_t ring_capacity;
+    std::chrono::milliseconds interval;
+
+    std::mutex writers_lock;
+    std::vector<std::shared_ptr<LeaderboardDeltas>> writers;
+
+    // merger state, guarded by merge_lock
+    std::mutex merge_lock;
+    std::vector<Totals> totals;
+
+    // product ids, reordered by every head()
+    std::vector<int> order;
+
+    // last published board, only held long enough to copy the pointer
+    std::mutex board_lock;
+    std::shared_ptr<const Board> board;
+
+    std::mutex stop_lock;
+    std::condition_variable stop_requested;
+    bool stopping = false;
+    std::thread merger;
+
+    /// @brief First `capacity` products sold by `value`: biggest value first, lowest id first among equal values
+    std::vector<LeaderboardEntry> head(long long int Totals::*value)
+    {
+        size_t count = std::min(this->capacity, this->order.size());
+        std::vector<LeaderboardEntry> entries;
+
+        std::partial_sort(this->order.begin(), this->order.begin() + count, this->order.end(), [&](int first, int second)
+        {
+            long long int first_value = this->totals[first].*value, second_value = this->totals[second].*value;
+            return first_value > second_value || (first_value == second_value && first < second);
+        });
+
+        for (size_t index = 0; index < count && this->totals[this->order[index]].*value > 0; ++index)
+        {
+            int id = this->order[index];
+            entries.push_back({id, this->totals[id].quantity, this->totals[id].revenue});
+        }
+
+        return entries;
+    }
+
+    void mergerLoop()
+    {
+        std::unique_lock<std::mutex> lock(this->stop_lock);
+
+        while (!this->stopping)
+        {
+            this->stop_requested.wait_for(lock, this->interval);
+
+            lock.unlock();
+            this->merge();
+            lock.lock();
+        }
+    }
+
+    std::vector<LeaderboardEntry> top(size_t count, bool by_revenue)
+    {
+        std::shared_ptr<const Board> current;
+        {
+            std::lock_guard<std::mutex> guard(this->board_lock);
+            current = this->board;
+        }
+
+        const std::vector<LeaderboardEntry> &entries = by_revenue ? current->by_revenue : current->by_quantity;
+        return std::vector<LeaderboardEntry>(entries.begin(), entries.begin() + std::min(count, entries.size()));
+    }
+
+public:
+    /// @brief Creates a leaderboard for products with ids in [1, product_count]
+    /// @param capacity Largest N answered by topByQuantity() and topByRevenue()
+    /// @param ring_capacity Sales every writer can queue before the next merge, a power of two
+    /// @param interval Time between two merges, the staleness bound of the answers
+    Leaderboard(int product_count, size_t capacity, size_t ring_capacity, std::chrono::milliseconds interval)
+        : capacity{capacity}, ring_capacity{ring_capacity}, interval{interval}, totals(product_count + 1), order(product_count),
+          board{std::make_shared<Board>()}
+    {
+        for (int id = 1; id <= product_count; ++id)
+            this->order[id - 1] = id;
+
+        this->merger = std::thread(&Leaderboard::mergerLoop, this);
+    }
+
+    Leaderboard(const Leaderboard &) = delete;
+    Leaderboard &operator=(const Leaderboard &) = delete;
+
+    ~Leaderboard()
+    {
+        {
+            std::lock_guard<std::mutex> guard(this->stop_lock);
+            this->stopping = true;
+        }
+
+        this->stop_requested.notify_all();
+        this->merger.join();
+    }
+
+    /// @brief Delta buffer for a sale thread, to be used by that thread only
+    std::shared_ptr<LeaderboardDeltas> registerWriter()
+    {
+        std::shared_ptr<LeaderboardDeltas> deltas = std::make_shared<LeaderboardDeltas>(this->ring_capacity, (int)this->order.size());
+
+        std::lock_guard<std::mutex> guard(this->writers_lock);
+        this->writers.push_back(deltas);
+
+        return deltas;
+    }
+
+    /// @brief Folds every pending delta into the totals and publishes a new board. Run by the merger, or directly to get an up-to-date board.
+    void merge()
+    {
+        std::lock_guard<std::mutex> merge_guard(this->merge_lock);
+        std::vector<std::shared_ptr<LeaderboardDeltas>> writers;
+        {
+            std::lock_guard<std::mutex> guard(this->writers_lock);
+            writers = this->writers;
+        }
+
+        LeaderboardDeltas::Delta delta;
+        bool changed = false;
+
+        for (const std::shared_ptr<LeaderboardDeltas> &writer : writers)
+        {
+            while (writer->ring.tryPop(delta))
+            {
+                Totals &totals = this->totals[delta.id];
+                totals.quantity += delta.quantity;
+                totals.revenue += delta.amount;
+                changed = true;
+            }
+        }
+
+        if (!changed)
+            return;
+
+        std::shared_ptr<Board> next = std::make_shared<Board>();
+        next->by_quantity = this->head(&Totals::quantity);
+        next->by_revenue = this->head(&Totals::revenue);
+
+        std::lock_guard<std::mutex> guard(this->board_lock);
+        this->board = next;
+    }
+
+    /// @brief Best sellers by units sold, most first, as of the last merge. O(count), never waits for a merge or a sale.
+    std::vector<LeaderboardEntry> topByQuantity(size_t count)
+    {
+        return this->top(count, false);
+    }
+
+    /// @brief Best sellers by money made, most first, as of the last merge
+    std::vector<LeaderboardEntry> topByRevenue(size_t count)
+    {
+        return this->top(count, true);
+    }
+};
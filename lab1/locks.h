@@ -0,0 +1,213 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Lock types usable by the entities. Besides lock(), unlock() and try_lock(), every lock exposes identity(), the address of
+// the lock that actually gets taken: two objects with the same identity share a lock and must not both be locked by one thread.
+// describe() tells the lock what it protects; only the profiling wrapper of profiler.h uses it.
+
+/// @brief Kind of object a lock protects
+enum LockSite
+{
+    PRODUCT_SITE,
+    BILL_SITE,
+    BILL_LIST_SITE,
+    // sales held back by ShopBankAccount::getTotalConsistent()
+    BANK_ACCOUNT_SITE,
+    LOCK_SITE_COUNT
+};
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+/// @brief One step of a spin-wait loop: pauses for the first iterations, then yields so a preempted lock holder can run
+inline void spinWait(int &spins)
+{
+    if (++spins < 64)
+        cpuRelax();
+    else std::this_thread::yield();
+}
+
+class MutexLock
+{
+private:
+    std::mutex object_lock;
+
+public:
+    void lock()
+    {
+        this->object_lock.lock();
+    }
+
+    bool try_lock()
+    {
+        return this->object_lock.try_lock();
+    }
+
+    void unlock()
+    {
+        this->object_lock.unlock();
+    }
+
+    const void *identity() const
+    {
+        return this;
+    }
+
+    void describe(LockSite, int) {}
+};
+
+/// @brief Test-and-test-and-set spinlock: waiters spin on a plain load and only retry the exchange once the lock looks free
+class SpinLock
+{
+private:
+    std::atomic<bool> locked = false;
+
+public:
+    void lock()
+    {
+        int spins = 0;
+
+        for (;;)
+        {
+            if (!this->locked.exchange(true, std::memory_order_acquire))
+                return;
+
+            while (this->locked.load(std::memory_order_relaxed))
+                spinWait(spins);
+        }
+    }
+
+    bool try_lock()
+    {
+        return !this->locked.load(std::memory_order_relaxed) && !this->locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        this->locked.store(false, std::memory_order_release);
+    }
+
+    const void *identity() const
+    {
+        return this;
+    }
+
+    void describe(LockSite, int) {}
+};
+
+/// @brief FIFO spinlock: every waiter takes a ticket and spins until it is served
+class TicketLock
+{
+private:
+    std::atomic<unsigned int> next_ticket = 0;
+    std::atomic<unsigned int> now_serving = 0;
+
+public:
+    void lock()
+    {
+        unsigned int ticket = this->next_ticket.fetch_add(1, std::memory_order_relaxed);
+        int spins = 0;
+
+        while (this->now_serving.load(std::memory_order_acquire) != ticket)
+            spinWait(spins);
+    }
+
+    bool try_lock()
+    {
+        unsigned int serving = this->now_serving.load(std::memory_order_relaxed);
+        unsigned int expected = serving;
+
+        return this->next_ticket.compare_exchange_strong(expected, serving + 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void unlock()
+    {
+        this->now_serving.store(this->now_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    const void *identity() const
+    {
+        return this;
+    }
+
+    void describe(LockSite, int) {}
+};
+
+/// @brief Handle to one of K shared mutexes. Handles get their stripe round-robin as they are created,
+/// so consecutive products land on different stripes.
+template <int K>
+class StripedLock
+{
+private:
+    struct alignas(64) Stripe
+    {
+        std::mutex object_lock;
+    };
+
+    static inline Stripe stripes[K];
+    static inline std::atomic<unsigned int> next_stripe = 0;
+
+    int stripe;
+
+public:
+    StripedLock() : stripe{(int)(next_stripe.fetch_add(1, std::memory_order_relaxed) % K)} {}
+
+    void lock()
+    {
+        stripes[this->stripe].object_lock.lock();
+    }
+
+    bool try_lock()
+    {
+        return stripes[this->stripe].object_lock.try_lock();
+    }
+
+    void unlock()
+    {
+        stripes[this->stripe].object_lock.unlock();
+    }
+
+    const void *identity() const
+    {
+        return &stripes[this->stripe];
+    }
+
+    void describe(LockSite, int) {}
+};
+
+// Lock policies: ProductLock guards a product, ObjectLock guards the other entities (bills, bill list).
+
+struct MutexPolicy
+{
+    using ProductLock = MutexLock;
+    using ObjectLock = MutexLock;
+};
+
+struct SpinLockPolicy
+{
+    using ProductLock = SpinLock;
+    using ObjectLock = SpinLock;
+};
+
+struct TicketLockPolicy
+{
+    using ProductLock = TicketLock;
+    using ObjectLock = TicketLock;
+};
+
+/// @brief K mutexes cover all the products, bills keep a mutex each
+template <int K>
+struct StripedLockPolicy
+{
+    using ProductLock = StripedLock<K>;
+    using ObjectLock = MutexLock;
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+
+// Recorded operation streams of the sale threads of one run. The file starts with a header, then holds every thread's stream
+// in thread order: its length followed by one 32-bit word per operation. Replaying a trace feeds every thread the exact
+// products and quantities it had, without drawing anything, so two backends replaying the same trace do the same work.
+
+/// @brief One recorded operation, the product id in the high 24 bits and the bought quantity in the low 8, 0 for a browse
+struct TraceOperation
+{
+    uint32_t word;
+
+    static constexpr int MAX_PRODUCT_ID = (1 << 24) - 1;
+    static constexpr int MAX_QUANTITY = (1 << 8) - 1;
+
+    TraceOperation() = default;
+
+    TraceOperation(int product_id, int quantity) : word{(uint32_t)product_id << 8 | (uint32_t)quantity}
+    {
+        if (product_id <= 0 || product_id > MAX_PRODUCT_ID || quantity < 0 || quantity > MAX_QUANTITY)
+            throw std::out_of_range("TraceOperation: cannot store product " + std::to_string(product_id) + " x" + std::to_string(quantity));
+    }
+
+    int getProductId() const
+    {
+        return this->word >> 8;
+    }
+
+    int getQuantity() const
+    {
+        return this->word & MAX_QUANTITY;
+    }
+
+    bool isBrowse() const
+    {
+        return this->getQuantity() == 0;
+    }
+};
+
+struct TraceHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t product_count;
+    uint32_t thread_count;
+    uint32_t padding;
+};
+
+class OperationTrace
+{
+private:
+    static constexpr uint64_t MAGIC = 0x45434152544f424cULL;
+    static constexpr uint32_t VERSION = 1;
+
+    int product_count;
+    std::vector<std::vector<TraceOperation>> streams;
+
+    static void check(bool ok, const std::string &what)
+    {
+        if (!ok)
+            throw std::runtime_error("OperationTrace: " + what + ": " + std::strerror(errno));
+    }
+
+public:
+    /// @brief Creates an empty trace of `thread_count` threads running on products with ids in [1, product_count]
+    OperationTrace(int product_count, int thread_count) : product_count{product_count}, streams(thread_count)
+    {
+        if (product_count > TraceOperation::MAX_PRODUCT_ID)
+            throw std::invalid_argument("OperationTrace: too many products");
+    }
+
+    int getProductCount() const
+    {
+        return this->product_count;
+    }
+
+    int getThreadCount() const
+    {
+        return this->streams.size();
+    }
+
+    long long int getOperationCount() const
+    {
+        long long int count = 0;
+
+        for (const std::vector<TraceOperation> &stream : this->streams)
+            count += stream.size();
+
+        return count;
+    }
+
+    /// @brief Operations of one thread. While recording, every thread only appends to its own stream.
+    std::vector<TraceOperation> &stream(int thread)
+    {
+        return this->streams[thread];
+    }
+
+    void save(const std::string &path) const
+    {
+        std::FILE *file = std::fopen(path.c_str(), "wb");
+        check(file != nullptr, "open " + path);
+
+        TraceHeader header{MAGIC, VERSION, (uint32_t)this->product_count, (uint32_t)this->streams.size(), 0};
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+        for (const std::vector<TraceOperation> &stream : this->streams)
+        {
+            uint64_t length = stream.size();
+            ok = ok && std::fwrite(&length, sizeof(length), 1, file) == 1;
+            ok = ok && std::fwrite(stream.data(), sizeof(TraceOperation), stream.size(), file) == stream.size();
+        }
+
+        ok = std::fclose(file) == 0 && ok;
+        check(ok, "write " + path);
+    }
+
+    static OperationTrace load(const std::string &path)
+    {
+        std::FILE *file = std::fopen(path.c_str(), "rb");
+        check(file != nullptr, "open " + path);
+
+        TraceHeader header;
+        if (std::fread(&header, sizeof(header), 1, file) != 1 || header.magic != MAGIC || header.version != VERSION)
+        {
+            std::fclose(file);
+            throw std::runtime_error("OperationTrace: " + path + " is not a valid trace");
+        }
+
+        OperationTrace trace(header.product_count, header.thread_count);
+
+        for (std::vector<TraceOperation> &stream : trace.streams)
+        {
+            uint64_t length;
+            bool ok = std::fread(&length, sizeof(length), 1, file) == 1;
+
+            if (ok)
+            {
+                stream.resize(length);
+                ok = std::fread(stream.data(), sizeof(TraceOperation), length, file) == length;
+            }
+
+            for (size_t index = 0; ok && index < stream.size(); ++index)
+                ok = stream[index].getProductId() > 0 && stream[index].getProductId() <= trace.product_count;
+
+            if (!ok)
+            {
+                std::fclose(file);
+                throw std::runtime_error("OperationTrace: " + path + " is truncated or refers to unknown products");
+            }
+        }
+
+        std::fclose(file);
+        return trace;
+    }
+};
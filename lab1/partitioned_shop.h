@@ -0,0 +1,329 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <pthread.h>
+#include <sched.h>
+#include "locks.h"
+#include "entities.h"
+#include "spsc_queue.h"
+
+// Shared-nothing execution of the shop. Products are spread over partitions by id, and every partition is owned by one thread,
+// the only one that ever reads or writes its products. Sale threads never touch a product: they send their requests to the
+// owner through a SPSC queue, one per (sale thread, partition) pair, so no cache line is written by two threads except the queue
+// indexes. Sold quantities and revenue stay in their partition until audit() or getRevenue() merges them.
+
+enum PartitionRequest
+{
+    // buy up to `quantity` units, clamped to the stock
+    SALE_REQUEST,
+    // first phase of a basket: set aside exactly `quantity` units, or nothing if there are not enough
+    PREPARE_REQUEST,
+    // second phase: sell the `quantity` units set aside by the prepare
+    COMMIT_REQUEST,
+    // second phase: put the `quantity` units set aside by the prepare back in stock
+    ABORT_REQUEST
+};
+
+/// @brief Votes of the partitions taking part in a basket, owned by the sale thread selling it
+struct alignas(64) BasketVote
+{
+    // prepares not answered yet
+    std::atomic<int> pending = 0;
+};
+
+struct PartitionMessage
+{
+    PartitionRequest type;
+    int product_id;
+    int quantity;
+
+    // prepare only: receives the units set aside, then `vote` is counted down
+    int *reserved;
+    BasketVote *vote;
+};
+
+/// @brief What a partition knows of one of its products
+struct PartitionProduct
+{
+    int price;
+    int quantity;
+    int initial_quantity;
+
+    // set aside by prepared baskets, neither in stock nor sold
+    int reserved;
+
+    long long int sold_quantity;
+    long long int sold_amount;
+};
+
+/// @brief Products and sales owned by one thread. Only its owner touches it while the shop runs.
+struct ShopPartition
+{
+    // product with id `id` is at index (id - 1) / partition_count of the partition (id - 1) % partition_count
+    std::vector<PartitionProduct> products;
+
+    long long int revenue = 0;
+    long long int sold_lines = 0;
+};
+
+/// @brief Product set split across owner threads, sold through message passing
+class PartitionedShop
+{
+private:
+    int partition_count;
+    int client_count;
+    bool pin_threads;
+
+    // initial price and quantity of every product, read by the owners while they build their partitions
+    std::vector<std::pair<int, int>> source;
+
+    std::vector<std::unique_ptr<ShopPartition>> partitions;
+
+    // queue from client c to partition p is queues[p * client_count + c]
+    std::vector<std::unique_ptr<SpscQueue<PartitionMessage>>> queues;
+
+    std::vector<std::thread> owners;
+    std::atomic<int> ready = 0;
+    std::atomic<bool> stopping = false;
+
+    SpscQueue<PartitionMessage> &queue(int partition, int client)
+    {
+        return *this->queues[partition * this->client_count + client];
+    }
+
+    int localIndex(int product_id)
+    {
+        return (product_id - 1) / this->partition_count;
+    }
+
+    static void pinToCore(int core)
+    {
+        cpu_set_t cores;
+        CPU_ZERO(&cores);
+        CPU_SET(core, &cores);
+        pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+    }
+
+    void handle(ShopPartition &partition, const PartitionMessage &message)
+    {
+        PartitionProduct &product = partition.products[this->localIndex(message.product_id)];
+        int quantity = message.quantity;
+
+        switch (message.type)
+        {
+        case SALE_REQUEST:
+            quantity = std::min(quantity, product.quantity);
+            product.quantity -= quantity;
+            break;
+        case PREPARE_REQUEST:
+            quantity = quantity <= product.quantity ? quantity : 0;
+            product.quantity -= quantity;
+            product.reserved += quantity;
+            *message.reserved = quantity;
+            message.vote->pending.fetch_sub(1, std::memory_order_release);
+            return;
+        case COMMIT_REQUEST:
+            product.reserved -= quantity;
+            break;
+        case ABORT_REQUEST:
+            product.reserved -= quantity;
+            product.quantity += quantity;
+            return;
+        }
+
+        product.sold_quantity += quantity;
+        product.sold_amount += (long long int)quantity * product.price;
+        partition.revenue += (long long int)quantity * product.price;
+        ++partition.sold_lines;
+    }
+
+    /// @brief Serves the requests of every client until stop(). The partition is allocated here, so its memory is local to the owner's core.
+    void ownerWork(int index)
+    {
+        if (this->pin_threads)
+            pinToCore(index % std::max(1u, std::thread::hardware_concurrency()));
+
+        std::unique_ptr<ShopPartition> partition = std::make_unique<ShopPartition>();
+        for (size_t id = index + 1; id <= this->source.size(); id += this->partition_count)
+            partition->products.push_back({this->source[id - 1].first, this->source[id - 1].second, this->source[id - 1].second, 0, 0, 0});
+
+        this->partitions[index] = std::move(partition);
+        this->ready.fetch_add(1, std::memory_order_release);
+
+        ShopPartition &owned = *this->partitions[index];
+        PartitionMessage message;
+        int spins = 0;
+
+        while (true)
+        {
+            // every push happened before stopping was set, so one more pass after seeing it drains everything
+            bool last_pass = this->stopping.load(std::memory_order_acquire);
+            bool served = false;
+
+            for (int client = 0; client < this->client_count; ++client)
+            {
+                SpscQueue<PartitionMessage> &inbound = this->queue(index, client);
+                while (inbound.tryPop(message))
+                {
+                    this->handle(owned, message);
+                    served = true;
+                }
+            }
+
+            if (last_pass)
+                return;
+
+            if (served)
+                spins = 0;
+            else spinWait(spins);
+        }
+    }
+
+public:
+    /// @brief Splits the products of `products` over `partition_count` owner threads, serving `client_count` sale threads
+    /// @param queue_capacity Capacity of every client to partition queue, a power of two
+    /// @param pin_threads Pin owner i to core i modulo the number of cores
+    template <typename Policy>
+    PartitionedShop(BasicProductTable<Policy> &products, int partition_count, int client_count, size_t queue_capacity, bool pin_threads)
+        : partition_count{partition_count}, client_count{client_count}, pin_threads{pin_threads}, partitions(partition_count)
+    {
+        if (partition_count <= 0 || client_count <= 0)
+            throw std::invalid_argument("PartitionedShop: needs at least one partition and one client");
+
+        for (BasicProduct<Policy> &product : products)
+            this->source.push_back({product.getPrice(), product.getQuantity()});
+
+        for (int index = 0; index < partition_count * client_count; ++index)
+            this->queues.push_back(std::make_unique<SpscQueue<PartitionMessage>>(queue_capacity));
+
+        for (int index = 0; index < partition_count; ++index)
+            this->owners.push_back(std::thread(&PartitionedShop::ownerWork, this, index));
+
+        while (this->ready.load(std::memory_order_acquire) < partition_count)
+            std::this_thread::yield();
+    }
+
+    PartitionedShop(const PartitionedShop &) = delete;
+    PartitionedShop &operator=(const PartitionedShop &) = delete;
+
+    ~PartitionedShop()
+    {
+        this->stop();
+    }
+
+    int partitionOf(int product_id)
+    {
+        return (product_id - 1) % this->partition_count;
+    }
+
+    /// @brief Queues a message for the owner of its product, waiting while the queue is full. Only called by `client`.
+    void send(int client, const PartitionMessage &message)
+    {
+        SpscQueue<PartitionMessage> &outbound = this->queue(this->partitionOf(message.product_id), client);
+        int spins = 0;
+
+        while (!outbound.tryPush(message))
+            spinWait(spins);
+    }
+
+    /// @brief Sells up to `quantity` units of a product without waiting for the owner
+    void sell(int client, int product_id, int quantity)
+    {
+        this->send(client, {SALE_REQUEST, product_id, quantity, nullptr, nullptr});
+    }
+
+    /// @brief Sells a basket with two-phase commit: every owner sets the units aside, and the basket is committed everywhere
+    /// only if all of them could, otherwise everything set aside goes back to stock.
+    /// @param reserved Scratch space of the calling client, resized to the basket
+    /// @return true if the basket was sold
+    bool sellBasket(int client, const std::vector<int> &product_ids, const std::vector<int> &quantities, std::vector<int> &reserved)
+    {
+        BasketVote vote;
+        size_t count = product_ids.size();
+
+        reserved.assign(count, 0);
+        vote.pending.store((int)count, std::memory_order_relaxed);
+
+        for (size_t index = 0; index < count; ++index)
+            this->send(client, {PREPARE_REQUEST, product_ids[index], quantities[index], &reserved[index], &vote});
+
+        int spins = 0;
+        while (vote.pending.load(std::memory_order_acquire) > 0)
+            spinWait(spins);
+
+        bool commit = true;
+        for (size_t index = 0; index < count; ++index)
+            commit = commit && reserved[index] == quantities[index];
+
+        for (size_t index = 0; index < count; ++index)
+            if (reserved[index] > 0)
+                this->send(client, {commit ? COMMIT_REQUEST : ABORT_REQUEST, product_ids[index], reserved[index], nullptr, nullptr});
+
+        return commit;
+    }
+
+    /// @brief Serves every request already sent and stops the owners. Must be called once all the clients are done.
+    void stop()
+    {
+        this->stopping.store(true, std::memory_order_release);
+
+        for (std::thread &owner : this->owners)
+            if (owner.joinable())
+                owner.join();
+    }
+
+    /// @brief Merged revenue of all the partitions, only exact once stopped
+    long long int getRevenue()
+    {
+        long long int revenue = 0;
+
+        for (std::unique_ptr<ShopPartition> &partition : this->partitions)
+            revenue += partition->revenue;
+
+        return revenue;
+    }
+
+    long long int getSoldLines()
+    {
+        long long int lines = 0;
+
+        for (std::unique_ptr<ShopPartition> &partition : this->partitions)
+            lines += partition->sold_lines;
+
+        return lines;
+    }
+
+    /// @brief Checks every product's stock against its sales and the revenue against the sold amounts. Only run once stopped.
+    /// @param product_id Receives the id of the first inconsistent product, or 0 if the revenue differs
+    bool audit(int &product_id)
+    {
+        long long int sold_amount = 0;
+        product_id = 0;
+
+        for (int index = 0; index < this->partition_count; ++index)
+        {
+            std::vector<PartitionProduct> &products = this->partitions[index]->products;
+
+            for (size_t local = 0; local < products.size(); ++local)
+            {
+                PartitionProduct &product = products[local];
+
+                if (product.reserved != 0 || product.initial_quantity - product.quantity != product.sold_quantity ||
+                    product.sold_amount != product.sold_quantity * product.price)
+                {
+                    product_id = (int)local * this->partition_count + index + 1;
+                    return false;
+                }
+
+                sold_amount += product.sold_amount;
+            }
+        }
+
+        return sold_amount == this->getRevenue();
+    }
+};
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include "locks.h"
+
+// Lock contention profiling. ProfiledLock wraps any lock of locks.h and records, per LockSite, how often it was taken,
+// how long threads waited for it and how long they held it. Every thread writes to its own stats block, blocks are only
+// merged when a summary is asked for, so the profiled hot path takes no extra shared cache line.
+// Profiling is opt-in through ProfiledPolicy: with the plain policies none of this is compiled in.
+
+/// @brief Power-of-two histogram of durations in nanoseconds, bucket i counts durations in [2^(i-1), 2^i)
+struct DurationHistogram
+{
+    static constexpr int BUCKET_COUNT = 40;
+
+    long long int buckets[BUCKET_COUNT] = {};
+    long long int count = 0;
+    long long int total_ns = 0;
+
+    void record(long long int nanoseconds)
+    {
+        int bucket = nanoseconds <= 0 ? 0 : 64 - __builtin_clzll((unsigned long long int)nanoseconds);
+        ++this->buckets[std::min(bucket, BUCKET_COUNT - 1)];
+        ++this->count;
+        this->total_ns += nanoseconds;
+    }
+
+    void merge(const DurationHistogram &other)
+    {
+        for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+            this->buckets[bucket] += other.buckets[bucket];
+
+        this->count += other.count;
+        this->total_ns += other.total_ns;
+    }
+
+    /// @brief Upper bound of the bucket holding the given percentile, in nanoseconds
+    static long long int bucketUpperBound(int bucket)
+    {
+        return bucket == 0 ? 0 : 1LL << bucket;
+    }
+
+    long long int percentile(double fraction) const
+    {
+        if (this->count == 0)
+            return 0;
+
+        long long int rank = (long long int)(fraction * this->count);
+        long long int seen = 0;
+
+        for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+        {
+            seen += this->buckets[bucket];
+            if (seen > rank)
+                return bucketUpperBound(bucket);
+        }
+
+        return bucketUpperBound(BUCKET_COUNT - 1);
+    }
+};
+
+/// @brief What one thread saw of the locks of one site
+struct SiteStats
+{
+    long long int acquisitions = 0;
+    long long int contended = 0;
+    long long int failed_try_locks = 0;
+    DurationHistogram wait;
+    DurationHistogram hold;
+
+    // contended acquisitions per object id, only touched when the lock was already taken
+    std::unordered_map<int, long long int> contended_objects;
+
+    void merge(const SiteStats &other)
+    {
+        this->acquisitions += other.acquisitions;
+        this->contended += other.contended;
+        this->failed_try_locks += other.failed_try_locks;
+        this->wait.merge(other.wait);
+        this->hold.merge(other.hold);
+
+        for (const auto &[object_id, count] : other.contended_objects)
+            this->contended_objects[object_id] += count;
+    }
+};
+
+/// @brief Collects the stats blocks of every profiled thread and merges them into a report
+class LockProfiler
+{
+private:
+    struct ThreadStats
+    {
+        SiteStats sites[LOCK_SITE_COUNT];
+    };
+
+    // blocks outlive their threads, so a summary can be printed after all the sale threads are joined
+    std::mutex registry_lock;
+    std::vector<std::unique_ptr<ThreadStats>> registry;
+
+    static inline thread_local ThreadStats *local_stats = nullptr;
+
+    ThreadStats &localStats()
+    {
+        if (local_stats == nullptr)
+        {
+            std::lock_guard<std::mutex> guard(this->registry_lock);
+            this->registry.push_back(std::make_unique<ThreadStats>());
+            local_stats = this->registry.back().get();
+        }
+
+        return *local_stats;
+    }
+
+    LockProfiler() = default;
+
+public:
+    static const char *siteName(LockSite site)
+    {
+        switch (site)
+        {
+        case PRODUCT_SITE:
+            return "product";
+        case BILL_SITE:
+            return "bill";
+        case BILL_LIST_SITE:
+            return "bill list";
+        case BANK_ACCOUNT_SITE:
+            return "bank account";
+        default:
+            return "unknown";
+        }
+    }
+
+    static LockProfiler &instance()
+    {
+        static LockProfiler profiler;
+        return profiler;
+    }
+
+    SiteStats &local(LockSite site)
+    {
+        return this->localStats().sites[site];
+    }
+
+    /// @brief Merges the stats of every thread for one site. Only exact once the profiled threads are done.
+    SiteStats collect(LockSite site)
+    {
+        std::lock_guard<std::mutex> guard(this->registry_lock);
+        SiteStats merged;
+
+        for (const std::unique_ptr<ThreadStats> &stats : this->registry)
+            merged.merge(stats->sites[site]);
+
+        return merged;
+    }
+
+    /// @brief Object ids of a site with the most contended acquisitions, most contended first
+    static std::vector<std::pair<int, long long int>> topContended(const SiteStats &stats, size_t count)
+    {
+        std::vector<std::pair<int, long long int>> objects(stats.contended_objects.begin(), stats.contended_objects.end());
+        count = std::min(count, objects.size());
+
+        std::partial_sort(objects.begin(), objects.begin() + count, objects.end(), [](const auto &left, const auto &right)
+                          { return left.second != right.second ? left.second > right.second : left.first < right.first; });
+        objects.resize(count);
+
+        return objects;
+    }
+
+    void printSummary(std::ostream &out, size_t top_count)
+    {
+        out << "==============================================\n";
+        out << "  Lock contention\n";
+        out << "  site | acquisitions | contended | failed try_lock | wait total | wait p50/p99 | hold p50/p99\n";
+
+        for (int site = 0; site < LOCK_SITE_COUNT; ++site)
+        {
+            SiteStats stats = this->collect((LockSite)site);
+            if (stats.acquisitions == 0 && stats.wait.count == 0)
+                continue;
+
+            out << "  " << siteName((LockSite)site) << "\t| " << stats.acquisitions << "\t| " << stats.contended << " ("
+                << (stats.acquisitions > 0 ? stats.contended * 100.0 / stats.acquisitions : 0.0) << "%)\t| " << stats.failed_try_locks
+                << "\t| " << stats.wait.total_ns / 1000000 << "ms\t| " << stats.wait.percentile(0.5) << "/" << stats.wait.percentile(0.99)
+                << "ns\t| " << stats.hold.percentile(0.5) << "/" << stats.hold.percentile(0.99) << "ns\n";
+        }
+
+        SiteStats products = this->collect(PRODUCT_SITE);
+        std::vector<std::pair<int, long long int>> top = topContended(products, top_count);
+
+        if (!top.empty())
+        {
+            out << "  most contended products:";
+            for (const auto &[product_id, count] : top)
+                out << " " << product_id << " (" << count << ")";
+            out << "\n";
+        }
+
+        out << "==============================================\n";
+    }
+
+    /// @brief Writes every counter, histogram bucket and contended object as `kind,site,key,value` rows
+    void writeCsv(const std::string &path)
+    {
+        std::ofstream out(path);
+        if (!out)
+            throw std::runtime_error("LockProfiler: cannot write " + path);
+
+        out << "kind,site,key,value\n";
+
+        for (int site = 0; site < LOCK_SITE_COUNT; ++site)
+        {
+            SiteStats stats = this->collect((LockSite)site);
+            const char *name = siteName((LockSite)site);
+
+            out << "counter," << name << ",acquisitions," << stats.acquisitions << "\n";
+            out << "counter," << name << ",contended," << stats.contended << "\n";
+            out << "counter," << name << ",failed_try_locks," << stats.failed_try_locks << "\n";
+            out << "counter," << name << ",wait_total_ns," << stats.wait.total_ns << "\n";
+            out << "counter," << name << ",hold_total_ns," << stats.hold.total_ns << "\n";
+
+            for (int bucket = 0; bucket < DurationHistogram::BUCKET_COUNT; ++bucket)
+            {
+                if (stats.wait.buckets[bucket] > 0)
+                    out << "wait_ns," << name << "," << DurationHistogram::bucketUpperBound(bucket) << "," << stats.wait.buckets[bucket] << "\n";
+                if (stats.hold.buckets[bucket] > 0)
+                    out << "hold_ns," << name << "," << DurationHistogram::bucketUpperBound(bucket) << "," << stats.hold.buckets[bucket] << "\n";
+            }
+
+            for (const auto &[object_id, count] : topContended(stats, stats.contended_objects.size()))
+                out << "contended_object," << name << "," << object_id << "," << count << "\n";
+        }
+    }
+};
+
+/// @brief Lock wrapper that reports acquisitions, wait and hold times of the inner lock to the LockProfiler
+template <typename Inner>
+class ProfiledLock
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    Inner inner;
+    LockSite site = PRODUCT_SITE;
+    int object_id = 0;
+
+    // written by the holder only
+    Clock::time_point acquired_at;
+
+    static long long int since(Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    void acquired(SiteStats &stats, long long int wait_ns)
+    {
+        ++stats.acquisitions;
+        stats.wait.record(wait_ns);
+        this->acquired_at = Clock::now();
+    }
+
+public:
+    void lock()
+    {
+        SiteStats &stats = LockProfiler::instance().local(this->site);
+
+        if (this->inner.try_lock())
+        {
+            this->acquired(stats, 0);
+            return;
+        }
+
+        Clock::time_point start = Clock::now();
+        this->inner.lock();
+
+        ++stats.contended;
+        ++stats.contended_objects[this->object_id];
+        this->acquired(stats, since(start));
+    }
+
+    bool try_lock()
+    {
+        SiteStats &stats = LockProfiler::instance().local(this->site);
+
+        if (!this->inner.try_lock())
+        {
+            ++stats.failed_try_locks;
+            ++stats.contended_objects[this->object_id];
+            return false;
+        }
+
+        this->acquired(stats, 0);
+        return true;
+    }
+
+    void unlock()
+    {
+        LockProfiler::instance().local(this->site).hold.record(since(this->acquired_at));
+        this->inner.unlock();
+    }
+
+    const void *identity() const
+    {
+        return this->inner.identity();
+    }
+
+    void describe(LockSite site, int object_id)
+    {
+        this->site = site;
+        this->object_id = object_id;
+        this->inner.describe(site, object_id);
+    }
+};
+
+/// @brief Wraps both locks of a policy of locks.h in a ProfiledLock
+template <typename Inner>
+struct ProfiledPolicy
+{
+    using ProductLock = ProfiledLock<typename Inner::ProductLock>;
+    using ObjectLock = ProfiledLock<typename Inner::ObjectLock>;
+};
+
+/// @brief Reports waits that happen outside of any lock of `Policy`, like sales held back by the bank account.
+/// Empty unless the policy is profiled, so code using an unprofiled policy contains no profiler call at all.
+template <typename Policy>
+struct WaitProfiler
+{
+    static constexpr bool enabled = false;
+
+    static void record(LockSite, long long int) {}
+};
+
+template <typename Inner>
+struct WaitProfiler<ProfiledPolicy<Inner>>
+{
+    static constexpr bool enabled = true;
+
+    static void record(LockSite site, long long int wait_ns)
+    {
+        SiteStats &stats = LockProfiler::instance().local(site);
+        ++stats.contended;
+        stats.wait.record(wait_ns);
+    }
+};
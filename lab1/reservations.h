@@ -0,0 +1,344 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include "entities.h"
+
+// Two-phase stock reservations. reserve() moves units of a product from its stock to its reserved units with one CAS and
+// returns a token; commit() sells them like a sale, cancel() puts them back. Reservations still held when their time is up
+// are put back by an expirer thread going through a timer wheel, one bucket per tick. Neither reserve(), cancel() nor the
+// expirer takes a product lock, so a checkout waiting for its payment never holds up a plain sale. A reservation made while
+// the expirer is going through the bucket of its deadline waits for the next turn of the wheel.
+
+/// @brief Handle of a reservation, only valid if reserve() succeeded
+struct ReservationToken
+{
+    int slot = -1;
+    uint64_t generation = 0;
+
+    bool valid() const
+    {
+        return this->slot >= 0;
+    }
+};
+
+template <typename Policy>
+class StockReservations
+{
+private:
+    enum SlotStatus : uint64_t
+    {
+        FREE_SLOT,
+        // waiting for commit(), cancel() or its expiry
+        HELD_SLOT,
+        // being set up by reserve(), or completed by whoever won it
+        BUSY_SLOT,
+        // completed, freed once the expirer takes it off the wheel
+        DONE_SLOT
+    };
+
+    struct alignas(64) Slot
+    {
+        // (generation << 2) | status, the generation changes whenever the slot is freed so old tokens no longer match
+        std::atomic<uint64_t> state = FREE_SLOT;
+
+        // written by reserve() before the slot is held, then only read
+        int product_id = 0;
+        int quantity = 0;
+        uint64_t deadline = 0;
+
+        // next slot of the same wheel bucket, only written by whoever pushes the slot
+        int next = -1;
+    };
+
+    BasicProductTable<Policy> &products;
+
+    std::unique_ptr<Slot[]> slots;
+    int capacity;
+    std::atomic<size_t> cursor = 0;
+
+    // every slot is in exactly one bucket from reserve() until the expirer frees it; a bucket is a stack of slot indexes
+    std::unique_ptr<std::atomic<int>[]> wheel;
+    int wheel_size;
+    std::chrono::milliseconds tick;
+    std::atomic<uint64_t> now = 0;
+
+    std::atomic<long long int> reserved_count = 0;
+    std::atomic<long long int> rejected_count = 0;
+    std::atomic<long long int> committed_count = 0;
+    std::atomic<long long int> cancelled_count = 0;
+    std::atomic<long long int> expired_count = 0;
+
+    std::mutex stop_lock;
+    std::condition_variable stop_requested;
+    bool stopping = false;
+    std::thread expirer;
+
+    static uint64_t state(uint64_t generation, SlotStatus status)
+    {
+        return generation << 2 | status;
+    }
+
+    void push(int index, uint64_t deadline)
+    {
+        std::atomic<int> &bucket = this->wheel[deadline % this->wheel_size];
+        Slot &slot = this->slots[index];
+
+        slot.next = bucket.load(std::memory_order_relaxed);
+        while (!bucket.compare_exchange_weak(slot.next, index, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+
+    /// @brief Finds a free slot and marks it busy, or returns -1 if every slot is in use
+    int claim(uint64_t &generation)
+    {
+        for (int attempt = 0; attempt < this->capacity; ++attempt)
+        {
+            Slot &slot = this->slots[this->cursor.fetch_add(1, std::memory_order_relaxed) % this->capacity];
+            uint64_t current = slot.state.load(std::memory_order_relaxed);
+
+            if ((current & 3) == FREE_SLOT &&
+                slot.state.compare_exchange_strong(current, state(current >> 2, BUSY_SLOT), std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                generation = current >> 2;
+                return &slot - this->slots.get();
+            }
+        }
+
+        return -1;
+    }
+
+    /// @brief Wins a held reservation for its completion, false if it was already completed or expired
+    bool take(const ReservationToken &token)
+    {
+        if (!token.valid() || token.slot >= this->capacity)
+            return false;
+
+        uint64_t held = state(token.generation, HELD_SLOT);
+        return this->slots[token.slot].state.compare_exchange_strong(held, state(token.generation, BUSY_SLOT), std::memory_order_acquire,
+                                                                     std::memory_order_relaxed);
+    }
+
+    /// @brief Moves to the next tick and goes through its bucket: completed slots are freed, held ones whose time is up expire,
+    /// the others go to the bucket of their deadline, or of the next tick while someone is completing them
+    void advance()
+    {
+        uint64_t now = this->now.fetch_add(1, std::memory_order_relaxed) + 1;
+        int index = this->wheel[now % this->wheel_size].exchange(-1, std::memory_order_acquire);
+
+        while (index >= 0)
+        {
+            Slot &slot = this->slots[index];
+            int next = slot.next;
+            uint64_t current = slot.state.load(std::memory_order_acquire);
+            uint64_t generation = current >> 2;
+
+            switch (current & 3)
+            {
+            case DONE_SLOT:
+                slot.state.store(state(generation + 1, FREE_SLOT), std::memory_order_release);
+                break;
+            case HELD_SLOT:
+                if (slot.deadline <= now &&
+                    slot.state.compare_exchange_strong(current, state(generation, BUSY_SLOT), std::memory_order_acquire, std::memory_order_relaxed))
+                {
+                    this->products[slot.product_id].releaseReserved(slot.quantity);
+                    this->expired_count.fetch_add(1, std::memory_order_relaxed);
+                    slot.state.store(state(generation + 1, FREE_SLOT), std::memory_order_release);
+                }
+                else this->push(index, std::max(slot.deadline, now + 1));
+                break;
+            default:
+                this->push(index, now + 1);
+                break;
+            }
+
+            index = next;
+        }
+    }
+
+    void expirerLoop()
+    {
+        std::unique_lock<std::mutex> lock(this->stop_lock);
+
+        while (!this->stopping)
+        {
+            this->stop_requested.wait_for(lock, this->tick);
+
+            lock.unlock();
+            this->advance();
+            lock.lock();
+        }
+    }
+
+public:
+    /// @brief Creates the reservations of the products of `products`
+    /// @param capacity Most reservations in use at once; a slot stays in use until the tick of its deadline, even once completed
+    /// @param wheel_size Buckets of the timer wheel, deadlines past the last one go round it again
+    /// @param tick Time between two buckets, the precision of the expiry
+    StockReservations(BasicProductTable<Policy> &products, int capacity, int wheel_size, std::chrono::milliseconds tick)
+        : products{products}, slots{new Slot[capacity]}, capacity{capacity}, wheel{new std::atomic<int>[wheel_size]}, wheel_size{wheel_size}, tick{tick}
+    {
+        if (capacity <= 0 || wheel_size <= 0 || tick.count() <= 0)
+            throw std::invalid_argument("StockReservations: capacity, wheel size and tick must be positive");
+
+        for (int index = 0; index < wheel_size; ++index)
+            this->wheel[index].store(-1, std::memory_order_relaxed);
+
+        this->expirer = std::thread(&StockReservations::expirerLoop, this);
+    }
+
+    StockReservations(const StockReservations &) = delete;
+    StockReservations &operator=(const StockReservations &) = delete;
+
+    ~StockReservations()
+    {
+        {
+            std::lock_guard<std::mutex> guard(this->stop_lock);
+            this->stopping = true;
+        }
+
+        this->stop_requested.notify_all();
+        this->expirer.join();
+    }
+
+    /// @brief Sets aside exactly `quantity` units of a product for `ttl`. Never clamps: the token is invalid if the stock is short
+    /// or every slot is in use.
+    ReservationToken reserve(int product_id, int quantity, std::chrono::milliseconds ttl)
+    {
+        BasicProduct<Policy> &product = this->products[product_id];
+
+        if (!product.reserve(quantity))
+        {
+            this->rejected_count.fetch_add(1, std::memory_order_relaxed);
+            return {};
+        }
+
+        uint64_t generation;
+        int index = this->claim(generation);
+
+        if (index < 0)
+        {
+            product.releaseReserved(quantity);
+            this->rejected_count.fetch_add(1, std::memory_order_relaxed);
+            return {};
+        }
+
+        Slot &slot = this->slots[index];
+        long long int ticks = (ttl.count() + this->tick.count() - 1) / this->tick.count();
+
+        slot.product_id = product_id;
+        slot.quantity = quantity;
+        slot.deadline = this->now.load(std::memory_order_relaxed) + std::max(ticks, 1LL);
+
+        slot.state.store(state(generation, HELD_SLOT), std::memory_order_release);
+        this->push(index, slot.deadline);
+        this->reserved_count.fetch_add(1, std::memory_order_relaxed);
+
+        return {index, generation};
+    }
+
+    /// @brief Sells the reserved units to `bill`, locking the product like any other sale
+    /// @return false if the reservation was already completed or has expired
+    bool commit(const ReservationToken &token, BasicBill<Policy> &bill, ShopBankAccount &shop_account)
+    {
+        if (!this->take(token))
+            return false;
+
+        Slot &slot = this->slots[token.slot];
+        BasicProduct<Policy> &product = this->products[slot.product_id];
+
+        product.lock();
+        shop_account.beginSale<Policy>();
+        product.beginWrite();
+        product.sellReserved(slot.quantity);
+        shop_account.registerTransaction(slot.quantity * product.getPrice());
+        bill.addProduct(slot.product_id, slot.quantity, product.getPrice());
+        product.endWrite();
+        shop_account.endSale();
+        product.unlock();
+
+        this->committed_count.fetch_add(1, std::memory_order_relaxed);
+        slot.state.store(state(token.generation, DONE_SLOT), std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Puts the reserved units back in stock
+    /// @return false if the reservation was already completed or has expired
+    bool cancel(const ReservationToken &token)
+    {
+        if (!this->take(token))
+            return false;
+
+        Slot &slot = this->slots[token.slot];
+        this->products[slot.product_id].releaseReserved(slot.quantity);
+
+        this->cancelled_count.fetch_add(1, std::memory_order_relaxed);
+        slot.state.store(state(token.generation, DONE_SLOT), std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Reservations made and not completed or expired yet
+    long long int getOutstandingCount()
+    {
+        return this->reserved_count.load(std::memory_order_relaxed) - this->committed_count.load(std::memory_order_relaxed) -
+               this->cancelled_count.load(std::memory_order_relaxed) - this->expired_count.load(std::memory_order_relaxed);
+    }
+
+    long long int getReservedCount()
+    {
+        return this->reserved_count.load(std::memory_order_relaxed);
+    }
+
+    long long int getRejectedCount()
+    {
+        return this->rejected_count.load(std::memory_order_relaxed);
+    }
+
+    long long int getCommittedCount()
+    {
+        return this->committed_count.load(std::memory_order_relaxed);
+    }
+
+    long long int getCancelledCount()
+    {
+        return this->cancelled_count.load(std::memory_order_relaxed);
+    }
+
+    long long int getExpiredCount()
+    {
+        return this->expired_count.load(std::memory_order_relaxed);
+    }
+
+    /// @brief Checks the reserved units of every product against the reservations held on it. Only run while no reservation
+    /// is being made or completed.
+    /// @param product_id Receives the id of the first product whose reserved units differ
+    bool audit(int &product_id)
+    {
+        std::vector<long long int> held(this->products.size() + 1);
+        product_id = 0;
+
+        for (int index = 0; index < this->capacity; ++index)
+            if ((this->slots[index].state.load(std::memory_order_acquire) & 3) == HELD_SLOT)
+                held[this->slots[index].product_id] += this->slots[index].quantity;
+
+        for (int id = 1; id <= this->products.size(); ++id)
+        {
+            if (this->products[id].getReservedQuantity() != held[id])
+            {
+                product_id = id;
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
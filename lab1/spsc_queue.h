@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <cstddef>
+
+/// @brief Bounded single-producer single-consumer ring. Each side caches the index of the other one and only reads the shared
+/// index again when the ring looks full or empty.
+template <typename T>
+class SpscQueue
+{
+private:
+    struct alignas(64) ProducerSide
+    {
+        std::atomic<size_t> tail = 0;
+        size_t cached_head = 0;
+    };
+
+    struct alignas(64) ConsumerSide
+    {
+        std::atomic<size_t> head = 0;
+        size_t cached_tail = 0;
+    };
+
+    std::unique_ptr<T[]> slots;
+    size_t mask;
+
+    ProducerSide producer;
+    ConsumerSide consumer;
+
+public:
+    /// @brief Creates a queue holding up to `capacity` values, which must be a power of two
+    explicit SpscQueue(size_t capacity) : slots{new T[capacity]}, mask{capacity - 1}
+    {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+            throw std::invalid_argument("SpscQueue: capacity must be a power of two");
+    }
+
+    bool tryPush(const T &value)
+    {
+        size_t tail = this->producer.tail.load(std::memory_order_relaxed);
+
+        if (tail - this->producer.cached_head > this->mask)
+        {
+            this->producer.cached_head = this->consumer.head.load(std::memory_order_acquire);
+            if (tail - this->producer.cached_head > this->mask)
+                return false;
+        }
+
+        this->slots[tail & this->mask] = value;
+        this->producer.tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &value)
+    {
+        size_t head = this->consumer.head.load(std::memory_order_relaxed);
+
+        if (head == this->consumer.cached_tail)
+        {
+            this->consumer.cached_tail = this->producer.tail.load(std::memory_order_acquire);
+            if (head == this->consumer.cached_tail)
+                return false;
+        }
+
+        value = this->slots[head & this->mask];
+        this->consumer.head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
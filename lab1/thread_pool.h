@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+/// @brief Fixed set of worker threads running index-parallel jobs. The workers are started once and wait between jobs,
+/// so a job only costs a wake-up instead of a thread creation.
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex pool_lock;
+    std::condition_variable job_ready;
+    std::condition_variable job_done;
+
+    // current job, guarded by pool_lock; `generation` changes whenever a new one starts
+    const std::function<void(int)> *job = nullptr;
+    int job_size = 0;
+    long long int generation = 0;
+    bool stopping = false;
+
+    // workers still inside the current job, it is not over before they all left it
+    int busy = 0;
+
+    std::atomic<int> next_index = 0;
+    std::atomic<int> remaining = 0;
+
+    /// @brief Runs indexes of the current job until none is left
+    void drain(const std::function<void(int)> &task, int size)
+    {
+        int index;
+
+        while ((index = this->next_index.fetch_add(1, std::memory_order_relaxed)) < size)
+        {
+            task(index);
+
+            if (this->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                std::lock_guard<std::mutex> guard(this->pool_lock);
+                this->job_done.notify_all();
+            }
+        }
+    }
+
+    void workerLoop()
+    {
+        long long int seen = 0;
+        std::unique_lock<std::mutex> lock(this->pool_lock);
+
+        while (true)
+        {
+            this->job_ready.wait(lock, [&]
+                                 { return this->stopping || (this->job != nullptr && this->generation != seen); });
+
+            if (this->stopping)
+                return;
+
+            seen = this->generation;
+            const std::function<void(int)> &task = *this->job;
+            int size = this->job_size;
+            ++this->busy;
+
+            lock.unlock();
+            this->drain(task, size);
+            lock.lock();
+
+            if (--this->busy == 0)
+                this->job_done.notify_all();
+        }
+    }
+
+public:
+    /// @brief Starts `thread_count` workers, at least one
+    explicit ThreadPool(int thread_count)
+    {
+        for (int index = 0; index < std::max(thread_count, 1); ++index)
+            this->workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(this->pool_lock);
+            this->stopping = true;
+        }
+
+        this->job_ready.notify_all();
+
+        for (std::thread &worker : this->workers)
+            worker.join();
+    }
+
+    int size()
+    {
+        return this->workers.size();
+    }
+
+    /// @brief Runs task(index) for every index in [0, count) on the workers and the calling thread, and returns once all are done.
+    /// Jobs submitted by several threads run one after the other.
+    void parallelFor(int count, const std::function<void(int)> &task)
+    {
+        if (count <= 0)
+            return;
+
+        std::unique_lock<std::mutex> lock(this->pool_lock);
+        this->job_done.wait(lock, [&]
+                            { return this->job == nullptr; });
+
+        this->job = &task;
+        this->job_size = count;
+        this->next_index.store(0, std::memory_order_relaxed);
+        this->remaining.store(count, std::memory_order_relaxed);
+        ++this->generation;
+
+        lock.unlock();
+        this->job_ready.notify_all();
+        this->drain(task, count);
+        lock.lock();
+
+        this->job_done.wait(lock, [&]
+                            { return this->remaining.load(std::memory_order_acquire) == 0 && this->busy == 0; });
+
+        this->job = nullptr;
+        this->job_done.notify_all();
+    }
+};
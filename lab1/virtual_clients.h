@@ -0,0 +1,346 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "locks.h"
+
+// Virtual clients: every client is a coroutine, and a few worker threads take turns resuming the ready ones. A client that
+// finds its product locked is suspended and queued on the lock instead of blocking its worker, which moves on to another
+// client; the unlock hands the lock over to the first queued client and makes it ready again.
+
+class ClientScheduler;
+
+/// @brief Coroutine type of a virtual client. It starts suspended and frees itself once done; ClientScheduler::spawn() runs it.
+class ClientTask
+{
+public:
+    struct promise_type
+    {
+        ClientScheduler *scheduler = nullptr;
+
+        ClientTask get_return_object()
+        {
+            return ClientTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+
+    explicit ClientTask(std::coroutine_handle<promise_type> handle) : handle{handle} {}
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    friend class ClientScheduler;
+};
+
+/// @brief Fixed set of worker threads resuming ready clients in FIFO order
+class ClientScheduler
+{
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex queue_lock;
+    std::condition_variable work_ready;
+    std::condition_variable all_done;
+    std::deque<std::coroutine_handle<>> ready;
+
+    // spawned clients not finished yet, guarded by queue_lock
+    long long int active = 0;
+    bool stopping = false;
+
+    // times a client went through the ready queue after an unlock handed it a lock, or after yield(), guarded by queue_lock
+    long long int wakeups = 0;
+    long long int yields = 0;
+
+    void workerLoop()
+    {
+        std::unique_lock<std::mutex> lock(this->queue_lock);
+
+        while (true)
+        {
+            this->work_ready.wait(lock, [&]
+                                  { return this->stopping || !this->ready.empty(); });
+
+            if (this->ready.empty())
+                return;
+
+            std::coroutine_handle<> client = this->ready.front();
+            this->ready.pop_front();
+
+            lock.unlock();
+            client.resume();
+            lock.lock();
+        }
+    }
+
+    void enqueue(std::coroutine_handle<> client, long long int &counter)
+    {
+        {
+            std::lock_guard<std::mutex> guard(this->queue_lock);
+            this->ready.push_back(client);
+            ++counter;
+        }
+
+        this->work_ready.notify_one();
+    }
+
+    void finished()
+    {
+        std::lock_guard<std::mutex> guard(this->queue_lock);
+
+        if (--this->active == 0)
+            this->all_done.notify_all();
+    }
+
+    friend struct ClientTask::promise_type::FinalAwaiter;
+
+public:
+    /// @brief Starts `worker_count` workers, at least one
+    explicit ClientScheduler(int worker_count)
+    {
+        for (int index = 0; index < std::max(worker_count, 1); ++index)
+            this->workers.push_back(std::thread(&ClientScheduler::workerLoop, this));
+    }
+
+    ClientScheduler(const ClientScheduler &) = delete;
+    ClientScheduler &operator=(const ClientScheduler &) = delete;
+
+    ~ClientScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> guard(this->queue_lock);
+            this->stopping = true;
+        }
+
+        this->work_ready.notify_all();
+
+        for (std::thread &worker : this->workers)
+            worker.join();
+    }
+
+    int size()
+    {
+        return this->workers.size();
+    }
+
+    /// @brief Makes a client suspended on a lock ready, it is resumed by the next free worker
+    void schedule(std::coroutine_handle<> client)
+    {
+        this->enqueue(client, this->wakeups);
+    }
+
+    void spawn(ClientTask task)
+    {
+        task.handle.promise().scheduler = this;
+
+        {
+            std::lock_guard<std::mutex> guard(this->queue_lock);
+            ++this->active;
+            this->ready.push_back(task.handle);
+        }
+
+        this->work_ready.notify_one();
+    }
+
+    /// @brief Waits until every spawned client is done
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(this->queue_lock);
+        this->all_done.wait(lock, [&]
+                            { return this->active == 0; });
+    }
+
+    /// @brief Clients that were handed a lock by an unlock
+    long long int getWakeupCount()
+    {
+        std::lock_guard<std::mutex> guard(this->queue_lock);
+        return this->wakeups;
+    }
+
+    /// @brief Clients that went back to the ready queue through yield()
+    long long int getYieldCount()
+    {
+        std::lock_guard<std::mutex> guard(this->queue_lock);
+        return this->yields;
+    }
+
+    /// @brief co_await to let the other ready clients run before going on. Every yield goes through the one ready queue of the
+    /// scheduler, so clients should only yield once they ran a batch of operations.
+    auto yield()
+    {
+        struct YieldAwaiter
+        {
+            ClientScheduler &scheduler;
+
+            bool await_ready()
+            {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> client)
+            {
+                this->scheduler.enqueue(client, this->scheduler.yields);
+            }
+
+            void await_resume() {}
+        };
+
+        return YieldAwaiter{*this};
+    }
+};
+
+inline void ClientTask::promise_type::FinalAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+{
+    ClientScheduler *scheduler = handle.promise().scheduler;
+    handle.destroy();
+    scheduler->finished();
+}
+
+/// @brief Lock that clients can wait for without blocking their worker. Threads use lock() as usual and spin while it is taken;
+/// an unlock with queued clients hands the lock to the first of them directly, so it never looks free in between.
+class AsyncLock
+{
+private:
+    struct Waiter
+    {
+        std::coroutine_handle<> client;
+        ClientScheduler *scheduler;
+        Waiter *next;
+    };
+
+    // guards locked and the waiter list, only held for a few instructions
+    SpinLock state_lock;
+    bool locked = false;
+    Waiter *first = nullptr;
+    Waiter *last = nullptr;
+
+public:
+    struct LockAwaiter
+    {
+        AsyncLock &lock;
+        Waiter waiter;
+
+        bool await_ready()
+        {
+            return this->lock.try_lock();
+        }
+
+        /// @return false to go on right away if the lock was released meanwhile
+        bool await_suspend(std::coroutine_handle<> client)
+        {
+            std::lock_guard<SpinLock> guard(this->lock.state_lock);
+
+            if (!this->lock.locked)
+            {
+                this->lock.locked = true;
+                return false;
+            }
+
+            this->waiter.client = client;
+            this->waiter.next = nullptr;
+
+            if (this->lock.last != nullptr)
+                this->lock.last->next = &this->waiter;
+            else this->lock.first = &this->waiter;
+
+            this->lock.last = &this->waiter;
+            return true;
+        }
+
+        void await_resume() {}
+    };
+
+    void lock()
+    {
+        int spins = 0;
+
+        while (!this->try_lock())
+            spinWait(spins);
+    }
+
+    bool try_lock()
+    {
+        std::lock_guard<SpinLock> guard(this->state_lock);
+
+        if (this->locked)
+            return false;
+
+        this->locked = true;
+        return true;
+    }
+
+    void unlock()
+    {
+        Waiter *next;
+        {
+            std::lock_guard<SpinLock> guard(this->state_lock);
+            next = this->first;
+
+            if (next == nullptr)
+            {
+                this->locked = false;
+                return;
+            }
+
+            this->first = next->next;
+            if (this->first == nullptr)
+                this->last = nullptr;
+        }
+
+        next->scheduler->schedule(next->client);
+    }
+
+    /// @brief co_await to take the lock from a client running on `scheduler`, suspending it while the lock is taken
+    LockAwaiter lockAsync(ClientScheduler &scheduler)
+    {
+        return LockAwaiter{*this, {nullptr, &scheduler, nullptr}};
+    }
+
+    const void *identity() const
+    {
+        return this;
+    }
+
+    void describe(LockSite, int) {}
+};
+
+/// @brief Products behind AsyncLocks, for sales run by virtual clients
+struct CoroutinePolicy
+{
+    using ProductLock = AsyncLock;
+    using ObjectLock = MutexLock;
+};
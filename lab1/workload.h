@@ -0,0 +1,196 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+// Workload generation for the sale threads. Every thread owns a WorkloadGenerator, a small xoshiro256** state plus a
+// reference to the shared, read-only Workload, so drawing a key takes no lock and touches no shared cache line that is written.
+
+/// @brief xoshiro256** generator, seeded through splitmix64 so nearby seeds give unrelated streams
+class Xoshiro256
+{
+private:
+    uint64_t state[4];
+
+    static uint64_t rotate(uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static uint64_t splitMix(uint64_t &seed)
+    {
+        uint64_t value = (seed += 0x9e3779b97f4a7c15ULL);
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        return value ^ (value >> 31);
+    }
+
+public:
+    explicit Xoshiro256(uint64_t seed)
+    {
+        for (uint64_t &word : this->state)
+            word = splitMix(seed);
+    }
+
+    uint64_t next()
+    {
+        uint64_t result = rotate(this->state[1] * 5, 7) * 9;
+        uint64_t shifted = this->state[1] << 17;
+
+        this->state[2] ^= this->state[0];
+        this->state[3] ^= this->state[1];
+        this->state[1] ^= this->state[2];
+        this->state[0] ^= this->state[3];
+        this->state[2] ^= shifted;
+        this->state[3] = rotate(this->state[3], 45);
+
+        return result;
+    }
+
+    /// @brief Uniform value in [0, bound) by multiply-shift, no division on the hot path
+    uint32_t below(uint32_t bound)
+    {
+        return (uint32_t)(((this->next() >> 32) * bound) >> 32);
+    }
+
+    /// @brief Uniform value in [0, 1)
+    double unit()
+    {
+        return (this->next() >> 11) * 0x1.0p-53;
+    }
+};
+
+enum KeyDistribution
+{
+    // every product is equally likely
+    UNIFORM_KEYS,
+    // product with rank r is picked with probability proportional to 1 / r^skew, product 1 being the best seller
+    ZIPF_KEYS,
+    // a fixed share of the operations goes to the first products, the rest is spread uniformly over the others
+    HOTSPOT_KEYS
+};
+
+enum OperationType
+{
+    // buy a random amount of a product
+    SALE_OPERATION,
+    // read the price and stock of a product without buying it
+    BROWSE_OPERATION
+};
+
+struct WorkloadConfig
+{
+    KeyDistribution distribution = UNIFORM_KEYS;
+
+    // exponent of the Zipf distribution, 0 is uniform, ~1 is typical best-seller traffic
+    double zipf_skew = 0.99;
+
+    // share of the products that are hot, and share of the operations that go to them
+    double hotspot_fraction = 0.01;
+    double hotspot_probability = 0.9;
+
+    // share of the operations that are sales, in percent, the rest are browses
+    int sale_percent = 100;
+};
+
+/// @brief Key distribution and operation mix of a run, for products with ids in [1, key_count]. Immutable once built,
+/// so it is shared by all the generators of the run.
+class Workload
+{
+private:
+    WorkloadConfig config;
+    int key_count;
+    int hot_count;
+
+    // cumulative weight of the Zipf ranks, cdf[r - 1] is the weight of ranks [1, r]
+    std::vector<double> cdf;
+
+public:
+    Workload(int key_count, WorkloadConfig config) : config{config}, key_count{key_count}
+    {
+        if (key_count <= 0)
+            throw std::invalid_argument("Workload: no keys to draw from");
+
+        this->hot_count = std::clamp((int)(key_count * config.hotspot_fraction), 1, key_count);
+
+        if (config.distribution == ZIPF_KEYS)
+        {
+            double total = 0;
+            this->cdf.reserve(key_count);
+
+            for (int rank = 1; rank <= key_count; ++rank)
+            {
+                total += 1.0 / std::pow((double)rank, config.zipf_skew);
+                this->cdf.push_back(total);
+            }
+        }
+    }
+
+    int getKeyCount() const
+    {
+        return this->key_count;
+    }
+
+    const WorkloadConfig &getConfig() const
+    {
+        return this->config;
+    }
+
+    /// @brief Draws a product id in [1, key_count]
+    int nextKey(Xoshiro256 &random) const
+    {
+        switch (this->config.distribution)
+        {
+        case ZIPF_KEYS:
+        {
+            double target = random.unit() * this->cdf.back();
+            int rank = std::upper_bound(this->cdf.begin(), this->cdf.end(), target) - this->cdf.begin();
+            return std::min(rank, this->key_count - 1) + 1;
+        }
+        case HOTSPOT_KEYS:
+            if (this->hot_count == this->key_count || random.unit() < this->config.hotspot_probability)
+                return random.below(this->hot_count) + 1;
+            return this->hot_count + random.below(this->key_count - this->hot_count) + 1;
+        default:
+            return random.below(this->key_count) + 1;
+        }
+    }
+
+    OperationType nextOperation(Xoshiro256 &random) const
+    {
+        if (this->config.sale_percent >= 100)
+            return SALE_OPERATION;
+
+        return (int)random.below(100) < this->config.sale_percent ? SALE_OPERATION : BROWSE_OPERATION;
+    }
+};
+
+/// @brief Per-thread view of a Workload with its own random state
+class WorkloadGenerator
+{
+private:
+    const Workload &workload;
+    Xoshiro256 random;
+
+public:
+    WorkloadGenerator(const Workload &workload, uint64_t seed) : workload{workload}, random{seed} {}
+
+    int nextKey()
+    {
+        return this->workload.nextKey(this->random);
+    }
+
+    OperationType nextOperation()
+    {
+        return this->workload.nextOperation(this->random);
+    }
+
+    /// @brief Uniform value in [low, high]
+    int nextInt(int low, int high)
+    {
+        return low + (int)this->random.below((uint32_t)(high - low + 1));
+    }
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DOT_KERNEL_X86 1
+#endif
+
+// Dot product kernels over int vectors, with AVX2, SSE4.1 and scalar versions; the best one the CPU supports is picked on the
+// first call. Other architectures only get the scalar kernels. Every product is computed in 64 bits, so no product ever overflows.
+//
+// dotProduct64() adds the products in 64-bit lanes, which is exact as long as the result fits in 64 bits and wraps modulo 2^64
+// otherwise. dotProduct128() is always exact: it splits every product into its low and high 32 bits and counts the negative ones,
+// three sums that cannot overflow their 64-bit lanes within a chunk of DOT_KERNEL_CHUNK elements, and folds them into a 128-bit
+// total after each chunk.
+
+typedef __int128 dot_int128_t;
+
+// elements summed in 64-bit lanes before they are folded into the 128-bit total, far below the 2^31 adds a lane can take
+#define DOT_KERNEL_CHUNK (1 << 24)
+
+// Sums of one chunk: the product p of two ints, read as an unsigned 64-bit u, is p = (u >> 32) * 2^32 + (u & (2^32 - 1)) - 2^64 * (u >> 63)
+struct DotChunkSums {
+    uint64_t low = 0;
+    uint64_t high = 0;
+    uint64_t negative = 0;
+
+    dot_int128_t total() const {
+        return ((dot_int128_t)this->high << 32) + (dot_int128_t)this->low - ((dot_int128_t)this->negative << 64);
+    }
+};
+
+inline uint64_t dotProduct64Scalar(const int *a, const int *b, size_t n) {
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; ++i)
+        sum += (uint64_t)((int64_t)a[i] * b[i]);
+
+    return sum;
+}
+
+inline DotChunkSums dotChunkScalar(const int *a, const int *b, size_t n) {
+    DotChunkSums sums;
+
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t product = (uint64_t)((int64_t)a[i] * b[i]);
+        sums.low += product & 0xffffffffu;
+        sums.high += product >> 32;
+        sums.negative += product >> 63;
+    }
+
+    return sums;
+}
+
+#ifdef DOT_KERNEL_X86
+
+__attribute__((target("sse4.1"))) inline uint64_t horizontalSum(__m128i lanes) {
+    return (uint64_t)_mm_cvtsi128_si64(lanes) + (uint64_t)_mm_extract_epi64(lanes, 1);
+}
+
+__attribute__((target("avx2"))) inline uint64_t horizontalSum(__m256i lanes) {
+    return horizontalSum(_mm_add_epi64(_mm256_castsi256_si128(lanes), _mm256_extracti128_si256(lanes, 1)));
+}
+
+// _mm_mul_epi32 multiplies the even 32-bit lanes into 64-bit products; shifting by 32 brings the odd lanes down for the second one
+__attribute__((target("sse4.1"))) inline uint64_t dotProduct64Sse(const int *a, const int *b, size_t n) {
+    __m128i sum = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+
+        sum = _mm_add_epi64(sum, _mm_mul_epi32(x, y));
+        sum = _mm_add_epi64(sum, _mm_mul_epi32(_mm_srli_epi64(x, 32), _mm_srli_epi64(y, 32)));
+    }
+
+    return horizontalSum(sum) + dotProduct64Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) inline DotChunkSums dotChunkSse(const int *a, const int *b, size_t n) {
+    const __m128i mask = _mm_set1_epi64x(0xffffffff);
+    __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128(), negative = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i products[] = {_mm_mul_epi32(x, y), _mm_mul_epi32(_mm_srli_epi64(x, 32), _mm_srli_epi64(y, 32))};
+
+        for (__m128i product : products) {
+            low = _mm_add_epi64(low, _mm_and_si128(product, mask));
+            high = _mm_add_epi64(high, _mm_srli_epi64(product, 32));
+            negative = _mm_add_epi64(negative, _mm_srli_epi64(product, 63));
+        }
+    }
+
+    DotChunkSums sums = dotChunkScalar(a + i, b + i, n - i);
+    sums.low += horizontalSum(low);
+    sums.high += horizontalSum(high);
+    sums.negative += horizontalSum(negative);
+    return sums;
+}
+
+__attribute__((target("avx2"))) inline uint64_t dotProduct64Avx2(const int *a, const int *b, size_t n) {
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+
+        sum = _mm256_add_epi64(sum, _mm256_mul_epi32(x, y));
+        sum = _mm256_add_epi64(sum, _mm256_mul_epi32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(y, 32)));
+    }
+
+    return horizontalSum(sum) + dotProduct64Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline DotChunkSums dotChunkAvx2(const int *a, const int *b, size_t n) {
+    const __m256i mask = _mm256_set1_epi64x(0xffffffff);
+    __m256i low = _mm256_setzero_si256(), high = _mm256_setzero_si256(), negative = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i products[] = {_mm256_mul_epi32(x, y), _mm256_mul_epi32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(y, 32))};
+
+        for (__m256i product : products) {
+            low = _mm256_add_epi64(low, _mm256_and_si256(product, mask));
+            high = _mm256_add_epi64(high, _mm256_srli_epi64(product, 32));
+            negative = _mm256_add_epi64(negative, _mm256_srli_epi64(product, 63));
+        }
+    }
+
+    DotChunkSums sums = dotChunkScalar(a + i, b + i, n - i);
+    sums.low += horizontalSum(low);
+    sums.high += horizontalSum(high);
+    sums.negative += horizontalSum(negative);
+    return sums;
+}
+
+#endif
+
+struct DotKernel {
+    const char *name;
+    uint64_t (*product64)(const int *, const int *, size_t);
+    DotChunkSums (*chunk)(const int *, const int *, size_t);
+};
+
+// kernel for the CPU running the program, picked once
+inline const DotKernel &dotKernel() {
+    static const DotKernel kernel = []() -> DotKernel {
+#ifdef DOT_KERNEL_X86
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+            return {"avx2", dotProduct64Avx2, dotChunkAvx2};
+        if (__builtin_cpu_supports("sse4.1"))
+            return {"sse4.1", dotProduct64Sse, dotChunkSse};
+#endif
+        return {"scalar", dotProduct64Scalar, dotChunkScalar};
+    }();
+
+    return kernel;
+}
+
+// exact when the result fits in 64 bits, modulo 2^64 otherwise
+inline int64_t dotProduct64(const int *a, const int *b, size_t n) {
+    return (int64_t)dotKernel().product64(a, b, n);
+}
+
+// always exact
+inline dot_int128_t dotProduct128(const int *a, const int *b, size_t n) {
+    dot_int128_t total = 0;
+
+    for (size_t i = 0; i < n; i += DOT_KERNEL_CHUNK) {
+        size_t count = std::min<size_t>(DOT_KERNEL_CHUNK, n - i);
+        total += dotKernel().chunk(a + i, b + i, count).total();
+    }
+
+    return total;
+}
+
+inline std::string toString(dot_int128_t value) {
+    if (value == 0)
+        return "0";
+
+    bool negative = value < 0;
+    unsigned __int128 magnitude = negative ? -(unsigned __int128)value : (unsigned __int128)value;
+    std::string digits;
+
+    for (; magnitude > 0; magnitude /= 10)
+        digits.insert(digits.begin(), (char)('0' + (int)(magnitude % 10)));
+
+    return negative ? "-" + digits : digits;
+}
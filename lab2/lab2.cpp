@@ -7,31 +7,58 @@
 #include <memory>
 #include <thread>
 #include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <unistd.h>
+#include "dot_kernel.h"
 
 using namespace std;
 
 #define ELEMENT_COUNT 600000
 
+// slots of the SPSC channel, a power of two
+#define CHANNEL_CAPACITY 4096
+
+// elements the producer reduces into one block in the batched mode, one run per size
+#define BLOCK_SIZES {1, 16, 256, 4096, 65536}
+
+// blocks going round between the producer and the consumer in the batched mode
+#define BLOCK_BUFFER_COUNT 4
+
+// vector sizes of the dot product engine benchmark; sizes whose vectors do not fit in the available memory are skipped
+#define DOT_PRODUCT_SIZES {100000LL, 1000000LL, 10000000LL, 100000000LL, 1000000000LL}
+
+// producer threads computing products over slices of the vectors, and consumer threads summing them
+#define DOT_PRODUCER_COUNT 4
+#define DOT_CONSUMER_COUNT 2
+
+// elements per block a producer reduces with the dot product kernel before handing the block's sum to its consumer
+#define DOT_BLOCK_SIZE 4096
+
+// times a channel side re-reads the other side's index before parking until it changes
+#define CHANNEL_SPIN_COUNT 1024
+
 mutex m;
 condition_variable cv;
 atomic_bool productReady = false;
 atomic_bool processed = true;
-atomic_int productValue = 0;
+atomic_llong productValue = 0;
 
 class ValueQueue{
 private:
-    queue<int> values;
+    queue<long long> values;
     mutex object_lock;
 
 public:
-    int pop() {
+    long long pop() {
         unique_lock lk(object_lock);
-        int value = this->values.front();
+        long long value = this->values.front();
         this->values.pop();
         return value;
     }
 
-    void push(int value) {
+    void push(long long value) {
         unique_lock lk(object_lock);
         this->values.push(value);
     }
@@ -42,15 +69,332 @@ public:
     }
 };
 
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    this_thread::yield();
+#endif
+}
+
+// Bounded single-producer single-consumer ring. Each side owns the cache line of its index and only reads the other side's
+// index again when the ring looks full or empty. A side that has nothing to do spins for a while, then parks on the other
+// side's index; the other side only pays for a wake-up when it sees it parked.
+template <typename T>
+class SpscChannel {
+private:
+    struct alignas(64) Side {
+        // tail for the producer, head for the consumer
+        atomic<size_t> index = 0;
+        // last index of the other side seen by this one
+        size_t cached = 0;
+        atomic_bool parked = false;
+    };
+
+    unique_ptr<T[]> slots;
+    size_t mask;
+
+    Side producer;
+    Side consumer;
+
+    // waits until `other` moves past `observed`, spinning first and parking after CHANNEL_SPIN_COUNT reads
+    static size_t awaitChange(Side &self, Side &other, size_t observed) {
+        size_t current;
+
+        for (int spins = 0; spins < CHANNEL_SPIN_COUNT; ++spins) {
+            current = other.index.load(memory_order_acquire);
+            if (current != observed)
+                return current;
+
+            if (spins < 64)
+                cpuRelax();
+            else this_thread::yield();
+        }
+
+        self.parked.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        while ((current = other.index.load(memory_order_acquire)) == observed)
+            other.index.wait(observed, memory_order_acquire);
+
+        self.parked.store(false, memory_order_relaxed);
+        return current;
+    }
+
+    // called after publishing a new index of `self`: wakes the other side if it parked waiting for it
+    static void wake(Side &self, Side &other) {
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (other.parked.load(memory_order_relaxed))
+            self.index.notify_one();
+    }
+
+public:
+    explicit SpscChannel(size_t capacity) : slots{new T[capacity]}, mask{capacity - 1} {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+            throw invalid_argument("SpscChannel: capacity must be a power of two");
+    }
+
+    void push(const T &value) {
+        size_t tail = this->producer.index.load(memory_order_relaxed);
+
+        while (tail - this->producer.cached > this->mask) {
+            this->producer.cached = this->consumer.index.load(memory_order_acquire);
+
+            if (tail - this->producer.cached > this->mask)
+                this->producer.cached = awaitChange(this->producer, this->consumer, this->producer.cached);
+        }
+
+        this->slots[tail & this->mask] = value;
+        this->producer.index.store(tail + 1, memory_order_release);
+        wake(this->producer, this->consumer);
+    }
+
+    // takes a value if there is one, without waiting
+    bool tryPop(T &value) {
+        size_t head = this->consumer.index.load(memory_order_relaxed);
+
+        if (head == this->consumer.cached) {
+            this->consumer.cached = this->producer.index.load(memory_order_acquire);
+
+            if (head == this->consumer.cached)
+                return false;
+        }
+
+        value = this->slots[head & this->mask];
+        this->consumer.index.store(head + 1, memory_order_release);
+        wake(this->consumer, this->producer);
+        return true;
+    }
+
+    T pop() {
+        size_t head = this->consumer.index.load(memory_order_relaxed);
+
+        while (head == this->consumer.cached) {
+            this->consumer.cached = this->producer.index.load(memory_order_acquire);
+
+            if (head == this->consumer.cached)
+                this->consumer.cached = awaitChange(this->consumer, this->producer, head);
+        }
+
+        T value = this->slots[head & this->mask];
+        this->consumer.index.store(head + 1, memory_order_release);
+        wake(this->consumer, this->producer);
+        return value;
+    }
+};
+
+void producerThreadChannel(vector<int> &v1, vector<int> &v2, int &size, SpscChannel<long long> &channel) {
+    for (int i = 0; i < size; ++i)
+        channel.push((long long)v1[i] * v2[i]);
+}
+
+void consumerThreadChannel(int &size, long long &result, SpscChannel<long long> &channel) {
+    result = 0;
+
+    for (int i = 0; i < size; ++i)
+        result += channel.pop();
+}
+
+// `count` elements reduced by the producer with the dot product kernel
+struct ProductBlock {
+    long long sum = 0;
+    int count = 0;
+};
+
+// reduces `block_size` elements at a time with the dot product kernel into free blocks and hands each one over; the consumer sends
+// emptied blocks back through `free_blocks`
+void producerThreadBlocks(vector<int> &v1, vector<int> &v2, int &size, int block_size, SpscChannel<ProductBlock *> &full_blocks, SpscChannel<ProductBlock *> &free_blocks) {
+    for (int i = 0; i < size;) {
+        ProductBlock *block = free_blocks.pop();
+        int count = min(block_size, size - i);
+
+        block->sum = dotProduct64(v1.data() + i, v2.data() + i, count);
+        block->count = count;
+        i += count;
+        full_blocks.push(block);
+    }
+}
+
+void consumerThreadBlocks(int &size, long long &result, SpscChannel<ProductBlock *> &full_blocks, SpscChannel<ProductBlock *> &free_blocks) {
+    result = 0;
+
+    for (int consumed = 0; consumed < size;) {
+        ProductBlock *block = full_blocks.pop();
+
+        result += block->sum;
+        consumed += block->count;
+        free_blocks.push(block);
+    }
+}
+
+// runs the batched mode with blocks of `block_size` elements, returns the elapsed time in microseconds
+long long runBlocks(vector<int> &v1, vector<int> &v2, int &size, int block_size, long long &result) {
+    vector<ProductBlock> blocks(BLOCK_BUFFER_COUNT);
+    SpscChannel<ProductBlock *> full_blocks(BLOCK_BUFFER_COUNT), free_blocks(BLOCK_BUFFER_COUNT);
+
+    for (ProductBlock &block : blocks)
+        free_blocks.push(&block);
+
+    auto start = std::chrono::steady_clock::now();
+
+    thread producer(producerThreadBlocks, ref(v1), ref(v2), ref(size), block_size, ref(full_blocks), ref(free_blocks));
+    thread consumer(consumerThreadBlocks, ref(size), ref(result), ref(full_blocks), ref(free_blocks));
+
+    producer.join();
+    consumer.join();
+
+    return chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// sum of one consumer, combined with the others by the tree reduction once `ready` is set
+struct alignas(64) PartialSum {
+    dot_int128_t value = 0;
+    atomic_bool ready = false;
+};
+
+// reduces its slice block by block with the dot product kernel and hands every block's sum to its consumer
+void dotProducer(const vector<int> &v1, const vector<int> &v2, long long begin, long long end, int block_size, SpscChannel<dot_int128_t> &sums) {
+    for (long long i = begin; i < end; i += block_size)
+        sums.push(dotProduct128(v1.data() + i, v2.data() + i, min((long long)block_size, end - i)));
+}
+
+// Adds the block sums of the producers consumer, consumer + consumer_count, ... until each of them sent `expected[p]` blocks,
+// then takes part in the tree reduction: at every level, the consumers whose index is a multiple of twice the stride add the sum
+// of the consumer one stride away, the others hand theirs over and stop. Consumer 0 ends up with the total.
+void dotConsumer(int consumer, vector<unique_ptr<SpscChannel<dot_int128_t>>> &links, const vector<long long> &expected, vector<PartialSum> &partials) {
+    int consumer_count = partials.size();
+    vector<int> producers;
+    vector<long long> remaining;
+
+    for (int p = consumer; p < (int)links.size(); p += consumer_count) {
+        producers.push_back(p);
+        remaining.push_back(expected[p]);
+    }
+
+    dot_int128_t sum = 0;
+    long long left = 0;
+    for (long long count : remaining)
+        left += count;
+
+    for (int spins = 0; left > 0;) {
+        bool found = false;
+
+        for (size_t k = 0; k < producers.size(); ++k) {
+            dot_int128_t block_sum;
+            if (remaining[k] == 0 || !links[producers[k]]->tryPop(block_sum))
+                continue;
+
+            sum += block_sum;
+            --remaining[k];
+            --left;
+            found = true;
+        }
+
+        if (found)
+            spins = 0;
+        else if (++spins < 64)
+            cpuRelax();
+        else this_thread::yield();
+    }
+
+    for (int stride = 1; stride < consumer_count; stride *= 2) {
+        if (consumer % (2 * stride) != 0)
+            break;
+
+        if (consumer + stride < consumer_count) {
+            PartialSum &other = partials[consumer + stride];
+            other.ready.wait(false, memory_order_acquire);
+            sum += other.value;
+        }
+    }
+
+    partials[consumer].value = sum;
+    partials[consumer].ready.store(true, memory_order_release);
+    partials[consumer].ready.notify_one();
+}
+
+// exact dot product of v1 and v2, computed by `producer_count` producers over equal slices and `consumer_count` consumers
+dot_int128_t dotProductEngine(const vector<int> &v1, const vector<int> &v2, int producer_count, int consumer_count, int block_size) {
+    long long size = v1.size();
+    vector<unique_ptr<SpscChannel<dot_int128_t>>> links;
+    vector<long long> expected;
+    vector<PartialSum> partials(consumer_count);
+    vector<thread> threads;
+
+    for (int p = 0; p < producer_count; ++p) {
+        long long slice = size * (p + 1) / producer_count - size * p / producer_count;
+
+        links.push_back(make_unique<SpscChannel<dot_int128_t>>(CHANNEL_CAPACITY));
+        expected.push_back((slice + block_size - 1) / block_size);
+    }
+
+    for (int c = 0; c < consumer_count; ++c)
+        threads.push_back(thread(dotConsumer, c, ref(links), cref(expected), ref(partials)));
+
+    for (int p = 0; p < producer_count; ++p)
+        threads.push_back(thread(dotProducer, cref(v1), cref(v2), size * p / producer_count, size * (p + 1) / producer_count, block_size, ref(*links[p])));
+
+    for (thread &t : threads)
+        t.join();
+
+    return partials[0].value;
+}
+
+// times the scalar loop, the dot product kernel alone and the engine on vectors of every size of DOT_PRODUCT_SIZES
+void runDotProductBenchmark() {
+    long long available = (long long)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGE_SIZE);
+
+    cout << "Dot product engine, " << DOT_PRODUCER_COUNT << " producers, " << DOT_CONSUMER_COUNT << " consumers, blocks of " << DOT_BLOCK_SIZE
+         << ", " << dotKernel().name << " kernel\n";
+
+    for (long long size : DOT_PRODUCT_SIZES) {
+        if (2 * size * (long long)sizeof(int) > available) {
+            cout << "\t" << size << " elements: skipped, the vectors do not fit in " << available / (1 << 20) << "MB\n";
+            continue;
+        }
+
+        vector<int> v1(size), v2(size);
+        for (long long i = 0; i < size; ++i) {
+            v1[i] = (int)(i + 1);
+            v2[i] = (int)(size - i);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        dot_int128_t expected = 0;
+        for (long long i = 0; i < size; ++i)
+            expected += (long long)v1[i] * v2[i];
+
+        auto sequential_us = chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+
+        dot_int128_t kernel_result = dotProduct128(v1.data(), v2.data(), size);
+
+        auto kernel_us = chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+
+        dot_int128_t result = dotProductEngine(v1, v2, DOT_PRODUCER_COUNT, DOT_CONSUMER_COUNT, DOT_BLOCK_SIZE);
+
+        auto engine_us = chrono::duration_cast<chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        cout << "\t" << size << " elements: scalar " << sequential_us << "us, kernel " << kernel_us << "us ("
+             << 2 * size * (long long)sizeof(int) / 1000 / max<long long>(kernel_us, 1) << "GB/s), engine " << engine_us << "us";
+        if (kernel_result != expected || result != expected)
+            cout << ", results differ: " << toString(expected) << ", " << toString(kernel_result) << " and " << toString(result);
+        cout << "\n";
+    }
+}
+
 void producerThreadQueue(vector<int> &v1, vector<int> &v2, int &size, ValueQueue &value_queue) {
     for (int i = 0; i < size; ++i) {
         unique_lock lk(m);
-        value_queue.push(v1[i] * v2[i]);
+        value_queue.push((long long)v1[i] * v2[i]);
         cv.notify_all();
     }
 }
 
-void consumerThreadQueue(int &size, int &result, ValueQueue &value_queue) {
+void consumerThreadQueue(int &size, long long &result, ValueQueue &value_queue) {
     result = 0;
 
     for (int i = 0; i < size; ++i) {
@@ -70,7 +414,7 @@ void producerThread(vector<int> &v1, vector<int> &v2, int &size) {
         cv.wait(lk, []
             { return processed == true; });
 
-        productValue = v1[i] * v2[i];
+        productValue = (long long)v1[i] * v2[i];
         processed = false;
         productReady = true;
 
@@ -78,7 +422,7 @@ void producerThread(vector<int> &v1, vector<int> &v2, int &size) {
     }
 }
 
-void consumerThread(int &size, int &result)
+void consumerThread(int &size, long long &result)
 {
     result = 0;
 
@@ -97,8 +441,9 @@ void consumerThread(int &size, int &result)
 }
 
 int main() {
-    int i, size = ELEMENT_COUNT, result, result_queue;
-    int expectedResult = 0;
+    int i, size = ELEMENT_COUNT;
+    long long result, result_queue, result_channel;
+    long long expectedResult = 0;
     
     vector<int> v1;
     vector<int> v2;
@@ -112,7 +457,7 @@ int main() {
     auto start_time = std::chrono::system_clock::to_time_t(start);
 
     for (i = 0; i < size; ++i){
-        expectedResult += v1[i] * v2[i];
+        expectedResult += (long long)v1[i] * v2[i];
     }
 
     auto end = std::chrono::system_clock::now();
@@ -122,6 +467,15 @@ int main() {
     cout << "Single thread result result: " << expectedResult << "\n";
     cout << "\tTotal elapsed time: " << elapsed_seconds << "ms\n\n";
 
+    start = std::chrono::system_clock::now();
+
+    long long result_kernel = dotProduct64(v1.data(), v2.data(), size);
+
+    end = std::chrono::system_clock::now();
+    auto elapsed_us = chrono::duration_cast<chrono::microseconds>(end - start).count();
+    cout << "Single thread " << dotKernel().name << " kernel result: " << result_kernel << "\n";
+    cout << "\tTotal elapsed time: " << elapsed_us << "us\n\n";
+
     start = std::chrono::system_clock::now();
     start_time = std::chrono::system_clock::to_time_t(start);
 
@@ -154,7 +508,34 @@ int main() {
     elapsed_seconds = chrono::duration_cast<chrono::milliseconds>(end - start).count();
     
     cout << "Threads + queue result: " << result_queue << "\n";
-    cout << "\tTotal elapsed time: " << elapsed_seconds << "ms\n";
+    cout << "\tTotal elapsed time: " << elapsed_seconds << "ms\n\n";
+
+    SpscChannel<long long> channel(CHANNEL_CAPACITY);
+
+    start = std::chrono::system_clock::now();
+
+    thread producerChannel(producerThreadChannel, ref(v1), ref(v2), ref(size), ref(channel));
+    thread consumerChannel(consumerThreadChannel, ref(size), ref(result_channel), ref(channel));
+
+    producerChannel.join();
+    consumerChannel.join();
+
+    end = std::chrono::system_clock::now();
+    elapsed_seconds = chrono::duration_cast<chrono::milliseconds>(end - start).count();
+
+    cout << "Threads + SPSC channel result: " << result_channel << "\n";
+    cout << "\tTotal elapsed time: " << elapsed_seconds << "ms\n\n";
+
+    for (int block_size : BLOCK_SIZES) {
+        long long result_blocks;
+        long long elapsed_us = runBlocks(v1, v2, size, block_size, result_blocks);
+
+        cout << "Threads + blocks of " << block_size << " result: " << result_blocks << "\n";
+        cout << "\tTotal elapsed time: " << elapsed_us << "us\n";
+    }
+
+    cout << "\n";
+    runDotProductBenchmark();
     cout << "=========================================\n";
 
     return 0;